@@ -15,6 +15,8 @@
 #include "LogInternal.hh"
 #include "VersionedDocument.hh"
 #include <assert.h>
+#include <mutex>
+#include <vector>
 
 using namespace forestdb;
 
@@ -122,13 +124,42 @@ struct c4Database : public Database {
             if (!commit)
                 t->abort();
             delete t; // this commits/aborts the transaction
+            if (commit)
+                notifyCommitObservers();
         }
         return true;
     }
 
+    void addCommitObserver(const void *owner, std::function<void()> observer) {
+        std::lock_guard<std::mutex> lock(_observersMutex);
+        _commitObservers.push_back(std::make_pair(owner, observer));
+    }
+
+    void removeCommitObservers(const void *owner) {
+        std::lock_guard<std::mutex> lock(_observersMutex);
+        for (auto o = _commitObservers.begin(); o != _commitObservers.end(); ) {
+            if (o->first == owner)
+                o = _commitObservers.erase(o);
+            else
+                ++o;
+        }
+    }
+
 private:
+    void notifyCommitObservers() {
+        std::vector<std::pair<const void*, std::function<void()>>> observers;
+        {
+            std::lock_guard<std::mutex> lock(_observersMutex);
+            observers = _commitObservers;
+        }
+        for (auto o = observers.begin(); o != observers.end(); ++o)
+            o->second();
+    }
+
     Transaction* _transaction;
     int _transactionLevel;
+    std::vector<std::pair<const void*, std::function<void()>>> _commitObservers; // owner, fn
+    std::mutex _observersMutex;
 };
 
 
@@ -136,6 +167,18 @@ forestdb::Database* asDatabase(C4Database *db) {
     return db;
 }
 
+C4Database* c4dbOpenAgain(C4Database *db) {
+    return new c4Database(db->filename(), db->getConfig());
+}
+
+void c4dbAddCommitObserver(C4Database *db, const void *owner, std::function<void()> observer) {
+    db->addCommitObserver(owner, observer);
+}
+
+void c4dbRemoveCommitObservers(C4Database *db, const void *owner) {
+    db->removeCommitObservers(owner);
+}
+
 
 Database::config c4DbConfig(C4DatabaseFlags flags, const C4EncryptionKey *key) {
     auto config = Database::defaultConfig();
@@ -560,6 +603,51 @@ bool c4doc_hasRevisionBody(C4Document* doc) {
 }
 
 
+struct C4BodyReader {
+    std::shared_ptr<const VersionedDocument> _owner;   // keeps an older doc version in memory
+    slice _body;
+    size_t _pos;
+};
+
+
+C4BodyReader* c4doc_openRevisionBody(C4Document* doc, C4Error *outError) {
+    auto idoc = internal(doc);
+    if (!idoc->loadRevisions(outError))
+        return NULL;
+    if (!idoc->_selectedRev) {
+        recordHTTPError(404, outError);
+        return NULL;
+    }
+    try {
+        std::unique_ptr<C4BodyReader> reader(new C4BodyReader);
+        reader->_body = idoc->_versionedDoc.bodyOfRevision(idoc->_selectedRev, reader->_owner);
+        reader->_pos = 0;
+        if (reader->_body.buf)
+            return reader.release();
+        recordHTTPError(410, outError); // 410 Gone to denote body that's been compacted away
+    } catchError(outError);
+    return NULL;
+}
+
+
+uint64_t c4bodyreader_getLength(C4BodyReader *reader) {
+    return reader->_body.size;
+}
+
+
+size_t c4bodyreader_read(C4BodyReader *reader, void *buffer, size_t maxBytes) {
+    size_t n = std::min(maxBytes, reader->_body.size - reader->_pos);
+    ::memcpy(buffer, (const uint8_t*)reader->_body.buf + reader->_pos, n);
+    reader->_pos += n;
+    return n;
+}
+
+
+void c4bodyreader_free(C4BodyReader *reader) {
+    delete reader;
+}
+
+
 bool c4doc_selectParentRevision(C4Document* doc) {
     auto idoc = internal(doc);
     if (idoc->_selectedRev)
@@ -721,6 +809,165 @@ bool c4doc_save(C4Document *doc,
 }
 
 
+// Returns the items' indexes sorted by docID (stably, so items for one doc keep their order),
+// and the distinct docIDs in that order.
+template <typename ITEM>
+static std::vector<unsigned> sortByDocID(const ITEM items[], unsigned count,
+                                         std::vector<std::string> &outDocIDs)
+{
+    std::vector<unsigned> order(count);
+    for (unsigned i = 0; i < count; ++i)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [items](unsigned a, unsigned b) {
+        return slice(items[a].docID) < slice(items[b].docID);
+    });
+    for (auto i = order.begin(); i != order.end(); ++i) {
+        if (outDocIDs.empty() || slice(outDocIDs.back()) != items[*i].docID)
+            outDocIDs.push_back((std::string)items[*i].docID);
+    }
+    return order;
+}
+
+
+bool c4db_insertRevisionsBatch(C4Database *database,
+                               const C4RevisionInsert revs[],
+                               unsigned count,
+                               unsigned maxRevTreeDepth,
+                               int outResults[],
+                               C4Error outErrors[],
+                               C4Error *outError)
+{
+    if (!database->mustBeInTransaction(outError))
+        return false;
+    try {
+        // Read all the distinct docs in a single pass in docID order:
+        std::vector<std::string> docIDs;
+        auto order = sortByDocID(revs, count, docIDs);
+        DocEnumerator e(*database, docIDs);
+
+        Transaction *t = database->transaction();
+        auto item = order.begin();
+        while (item != order.end() && e.next()) {
+            VersionedDocument vdoc(*database, e.doc());
+            // Apply all the items for this doc:
+            bool changed = false;
+            auto firstItem = item;
+            for (; item != order.end() && revs[*item].docID == vdoc.docID(); ++item) {
+                const C4RevisionInsert &rev = revs[*item];
+                int result = -1;
+                try {
+                    if (rev.historyCount > 0) {
+                        std::vector<revidBuffer> history(rev.historyCount);
+                        for (unsigned h = 0; h < rev.historyCount; ++h)
+                            history[h].parse(rev.history[h]);
+                        result = vdoc.insertHistory(history, rev.body,
+                                                    rev.deleted, rev.hasAttachments);
+                        if (result < 0)
+                            recordHTTPError(400, outErrors ? &outErrors[*item] : NULL);
+                    } else {
+                        result = 0;
+                    }
+                } catchError(outErrors ? &outErrors[*item] : NULL)
+                outResults[*item] = result;
+                changed = changed || result > 0;
+            }
+            if (!changed)
+                continue;
+
+            // Save the doc once; if that fails, all of its items fail:
+            C4Error saveError;
+            bool saved = false;
+            try {
+                vdoc.prune(maxRevTreeDepth);
+                vdoc.save(*t);
+                saved = true;
+            } catchError(&saveError)
+            if (!saved) {
+                for (auto i = firstItem; i != item; ++i) {
+                    outResults[*i] = -1;
+                    if (outErrors)
+                        outErrors[*i] = saveError;
+                }
+            }
+        }
+        return true;
+    } catchError(outError)
+    return false;
+}
+
+
+bool c4db_findMissingRevisions(C4Database *database,
+                               C4RevsDiff diffs[],
+                               unsigned count,
+                               C4Error *outError)
+{
+    for (unsigned i = 0; i < count; ++i)
+        diffs[i].possibleAncestors = {NULL, 0};
+    try {
+        std::vector<std::string> docIDs;
+        auto order = sortByDocID(diffs, count, docIDs);
+
+        // Read only the docs' metadata at first:
+        auto options = DocEnumerator::Options::kDefault;
+        options.contentOptions = KeyStore::kMetaOnly;
+        DocEnumerator e(*database, docIDs, options);
+
+        auto item = order.begin();
+        while (item != order.end() && e.next()) {
+            VersionedDocument vdoc(*database, e.doc());
+            for (; item != order.end() && diffs[*item].docID == vdoc.docID(); ++item) {
+                C4RevsDiff &diff = diffs[*item];
+                unsigned maxMissingGen = 0;
+                for (unsigned r = 0; r < diff.revIDCount; ++r) {
+                    revidBuffer revID;
+                    try {
+                        revID.parse(diff.revIDs[r]);
+                    } catch (error) {
+                        diff.missing[r] = true;     // an invalid revID can't exist
+                        continue;
+                    }
+                    if (!vdoc.exists()) {
+                        diff.missing[r] = true;
+                        continue;
+                    }
+                    if (revID == vdoc.revID()) {
+                        diff.missing[r] = false;    // it's the current revision; no need to look
+                        continue;
+                    }
+                    if (!vdoc.revsAvailable())
+                        vdoc.read();                // now we need the rev tree
+                    diff.missing[r] = (vdoc.get(revID) == NULL);
+                    if (diff.missing[r])
+                        maxMissingGen = std::max(maxMissingGen, revID.generation());
+                }
+
+                if (maxMissingGen > 0 && vdoc.revsAvailable()) {
+                    // Possible ancestors are the leaves older than the newest missing rev:
+                    std::string json = "[";
+                    auto leaves = vdoc.currentRevisions();
+                    for (auto leaf = leaves.begin(); leaf != leaves.end(); ++leaf) {
+                        if ((*leaf)->revID.generation() >= maxMissingGen)
+                            continue;
+                        if (json.size() > 1)
+                            json += ",";
+                        json += "\"" + (std::string)(*leaf)->revID.expanded() + "\"";
+                    }
+                    if (json.size() > 1) {
+                        json += "]";
+                        slice result = slice(json).copy();
+                        diff.possibleAncestors = {result.buf, result.size};
+                    }
+                }
+            }
+        }
+        return true;
+    } catchError(outError)
+    for (unsigned i = 0; i < count; ++i)
+        free((void*)diffs[i].possibleAncestors.buf);
+    return false;
+}
+
+
 #pragma mark - DOC ENUMERATION:
 
 const C4EnumeratorOptions kC4DefaultEnumeratorOptions = {
@@ -733,6 +980,7 @@ struct C4DocEnumerator {
     C4Database *_database;
     DocEnumerator _e;
     C4EnumeratorOptions _options;
+    C4DocumentFilter _filter;
 
     C4DocEnumerator(C4Database *database,
                     sequence start,
@@ -776,12 +1024,16 @@ struct C4DocEnumerator {
             if (!_e.next())
                 return NULL;
         } while (!useDoc());
+        if (_filter && !(_options.flags & kC4IncludeBodies)) {
+            // The filter was applied to the metadata; now read the whole doc:
+            return new C4DocumentInternal(_database, _e.doc().key());
+        }
         return new C4DocumentInternal(_database, _e.doc());
     }
 
     inline bool useDoc() {
         auto optFlags = _options.flags;
-        if ((optFlags & kC4IncludeDeleted) && (optFlags & kC4IncludeNonConflicted))
+        if ((optFlags & kC4IncludeDeleted) && (optFlags & kC4IncludeNonConflicted) && !_filter)
             return true;
         VersionedDocument::Flags docFlags;
         revid revID;
@@ -789,7 +1041,9 @@ struct C4DocEnumerator {
         if (!VersionedDocument::readMeta(_e.doc(), docFlags, revID, docType))
             return false;
         return (optFlags & kC4IncludeDeleted       || !(docFlags & VersionedDocument::kDeleted))
-            && (optFlags & kC4IncludeNonConflicted ||  (docFlags & VersionedDocument::kConflicted));
+            && (optFlags & kC4IncludeNonConflicted ||  (docFlags & VersionedDocument::kConflicted))
+            && (!_filter || _filter(_e.doc().key(), _e.doc().sequence(),
+                                    (C4DocumentFlags)docFlags, docType));
     }
 };
 
@@ -812,6 +1066,17 @@ C4DocEnumerator* c4db_enumerateChanges(C4Database *database,
 }
 
 
+C4DocEnumerator* c4EnumerateChangesFiltered(C4Database *database,
+                                            C4SequenceNumber since,
+                                            const C4EnumeratorOptions &options,
+                                            C4DocumentFilter filter)
+{
+    auto e = new C4DocEnumerator(database, since+1, UINT64_MAX, options);
+    e->_filter = filter;
+    return e;
+}
+
+
 C4DocEnumerator* c4db_enumerateAllDocs(C4Database *database,
                                        C4Slice startDocID,
                                        C4Slice endDocID,
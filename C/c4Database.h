@@ -191,7 +191,9 @@ extern "C" {
     bool c4doc_selectCurrentRevision(C4Document* doc);
 
     /** Populates the body field of a doc's selected revision,
-        if it was initially loaded without its body. */
+        if it was initially loaded without its body.
+        If the body is no longer available (it's been compacted away) this returns false with
+        a 410 error, so there's no need to call c4doc_hasRevisionBody first. */
     bool c4doc_loadRevisionBody(C4Document* doc,
                                 C4Error *outError);
 
@@ -199,6 +201,29 @@ extern "C" {
         i.e. if c4doc_loadRevisionBody() would succeed. */
     bool c4doc_hasRevisionBody(C4Document* doc);
 
+    /** Opaque handle to a reader that copies a revision body out in chunks. */
+    typedef struct C4BodyReader C4BodyReader;
+
+    /** Opens a reader on the body of a doc's selected revision. Unlike c4doc_loadRevisionBody,
+        this doesn't make a copy of a body stored in an older version of the document; the
+        caller reads it in pieces into its own buffers with c4bodyreader_read.
+        The reader must be freed before the document is.
+        If the body is no longer available this returns NULL with a 410 error. */
+    C4BodyReader* c4doc_openRevisionBody(C4Document* doc,
+                                         C4Error *outError);
+
+    /** Returns the total length in bytes of the body being read. */
+    uint64_t c4bodyreader_getLength(C4BodyReader*);
+
+    /** Copies up to maxBytes of the body into the buffer, continuing from where the last call
+        left off. Returns the number of bytes copied, or 0 at the end of the body. */
+    size_t c4bodyreader_read(C4BodyReader*,
+                             void *buffer,
+                             size_t maxBytes);
+
+    /** Frees a body reader. */
+    void c4bodyreader_free(C4BodyReader*);
+
     /** Selects the parent of the selected revision, if it's known, else returns NULL. */
     bool c4doc_selectParentRevision(C4Document* doc);
 
@@ -369,6 +394,73 @@ extern "C" {
                     C4Error *outError);
 
 
+
+    //////// BATCH INSERTION (for replication):
+
+
+    /** Describes one revision to be added by c4db_insertRevisionsBatch. */
+    typedef struct {
+        C4Slice docID;              /**< The document ID */
+        C4Slice body;               /**< The (JSON) body of the new revision */
+        bool deleted;               /**< True if the revision is a deletion (tombstone) */
+        bool hasAttachments;        /**< True if the revision contains an _attachments dict */
+        const C4Slice *history;     /**< Revision IDs, starting with the new revision's,
+                                         in reverse chronological order */
+        unsigned historyCount;      /**< The number of items in the history array */
+    } C4RevisionInsert;
+
+    /** Adds many revisions, with their histories, to many documents at once. This is equivalent
+        to calling c4doc_get, c4doc_insertRevisionWithHistory and c4doc_save for each item, but
+        faster: the documents are read and written in docID order, and each document is read and
+        saved only once even if several items refer to it.
+        Must be called within a transaction.
+        @param database  The database.
+        @param revs  The revisions to insert.
+        @param count  The number of items in the revs array.
+        @param maxRevTreeDepth  The depth to prune the documents' revision trees to.
+        @param outResults  Caller-allocated array of `count` ints. Each will be set to the number
+                        of revisions added to that item's document, or -1 on error.
+        @param outErrors  Optional caller-allocated array of `count` C4Errors. The error of
+                        each item whose result is -1 will be stored here.
+        @param outError  Error information is stored here if the whole batch fails.
+        @return  True if the batch was processed (even if some items failed), false if not. */
+    bool c4db_insertRevisionsBatch(C4Database *database,
+                                   const C4RevisionInsert revs[],
+                                   unsigned count,
+                                   unsigned maxRevTreeDepth,
+                                   int outResults[],
+                                   C4Error outErrors[],
+                                   C4Error *outError);
+
+
+    /** Describes one document's revisions to be checked by c4db_findMissingRevisions.
+        The first three fields are inputs; the last two are filled in by the call. */
+    typedef struct {
+        C4Slice docID;              /**< (in) The document ID */
+        const C4Slice *revIDs;      /**< (in) Revision IDs to look for */
+        unsigned revIDCount;        /**< (in) The number of items in the revIDs array */
+        bool *missing;              /**< (out) Caller-allocated array of revIDCount flags; each is
+                                         set to true if that revision doesn't exist locally */
+        C4SliceResult possibleAncestors; /**< (out) If any revision is missing, a JSON array of the
+                                         IDs of local leaf revisions with lower generations
+                                         (which may be ancestors of the missing ones); otherwise
+                                         null. Caller must free it with c4slice_free(). */
+    } C4RevsDiff;
+
+    /** Determines which of a set of revisions of many documents don't exist in the database.
+        (This is the storage side of CouchDB's _revs_diff.) Documents are looked up in docID
+        order, and their revision trees are only read when the current revision ID doesn't
+        answer the question.
+        @param database  The database.
+        @param diffs  The documents and revisions to check. Results are stored back into them.
+        @param count  The number of items in the diffs array.
+        @param outError  Error information is stored here.
+        @return  True on success, false on failure. */
+    bool c4db_findMissingRevisions(C4Database *database,
+                                   C4RevsDiff diffs[],
+                                   unsigned count,
+                                   C4Error *outError);
+
 #ifdef __cplusplus
 }
 #endif
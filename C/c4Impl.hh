@@ -11,6 +11,7 @@
 
 #include "slice.hh"
 #include "Database.hh"
+#include <functional>
 
 typedef forestdb::slice C4Slice;
 
@@ -32,6 +33,28 @@ Database::config c4DbConfig(C4DatabaseFlags flags, const C4EncryptionKey *key);
 
 Database* asDatabase(C4Database*);
 
+/** Opens another handle on the same database file, with the same configuration, for use on a
+    different thread. */
+C4Database* c4dbOpenAgain(C4Database*);
+
+/** Adds a function to be called after each transaction committed through this handle. The owner
+    is just an identifier for c4dbRemoveCommitObservers; a handle can have any number of them. */
+void c4dbAddCommitObserver(C4Database*, const void *owner, std::function<void()>);
+
+/** Removes all the commit observers added with the given owner. */
+void c4dbRemoveCommitObservers(C4Database*, const void *owner);
+
+/** Decides from a document's metadata (docID, sequence, flags, docType) whether an enumerator
+    should return it. */
+typedef std::function<bool(slice, sequence, C4DocumentFlags, slice)> C4DocumentFilter;
+
+/** Like c4db_enumerateChanges, but skips documents rejected by the filter. If the options don't
+    include kC4IncludeBodies, only metadata is read until the filter accepts a document. */
+C4DocEnumerator* c4EnumerateChangesFiltered(C4Database*,
+                                            C4SequenceNumber since,
+                                            const C4EnumeratorOptions&,
+                                            C4DocumentFilter);
+
 
 void recordError(C4ErrorDomain domain, int code, C4Error* outError);
 void recordHTTPError(int httpStatus, C4Error* outError);
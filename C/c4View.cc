@@ -10,8 +10,18 @@
 #include "c4View.h"
 #include "Collatable.hh"
 #include "MapReduceIndex.hh"
+#include "VersionedDocument.hh"
+#include "varint.hh"
+#include "LogInternal.hh"
 #include <math.h>
 #include <limits.h>
+#include <algorithm>
+#include <map>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 using namespace forestdb;
 
 
@@ -111,9 +121,183 @@ C4SliceResult c4key_toJSON(const C4KeyReader* r) {
 }
 
 
+#pragma mark - QUERY CACHE:
+
+
+/** Remembers the complete results of recent queries on a view, as long as the index doesn't
+    change (i.e. its lastSequenceChangedAt stays the same.) Each result is kept as a single
+    buffer of encoded rows; the least recently used ones are evicted to stay within maxBytes. */
+class QueryCache {
+public:
+    typedef std::shared_ptr<const std::string> Rows;
+
+    QueryCache()                                    :_maxBytes(0), _bytes(0), _changedAt(0),
+                                                     _clock(0) { }
+
+    size_t maxBytes() const                         {return _maxBytes;}
+
+    void setMaxBytes(size_t maxBytes) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _maxBytes = maxBytes;
+        evict(0);
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _entries.clear();
+        _bytes = 0;
+    }
+
+    Rows get(const std::string &queryKey, sequence changedAt) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (changedAt != _changedAt)
+            return Rows();
+        auto i = _entries.find(queryKey);
+        if (i == _entries.end())
+            return Rows();
+        i->second.lastUsed = ++_clock;
+        return i->second.rows;
+    }
+
+    void put(const std::string &queryKey, sequence changedAt, Rows rows) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (changedAt != _changedAt) {
+            // The index has changed since the cached results were generated:
+            _entries.clear();
+            _bytes = 0;
+            _changedAt = changedAt;
+        }
+        size_t size = entrySize(queryKey, *rows);
+        if (size > _maxBytes || _entries.count(queryKey) > 0)
+            return;
+        evict(size);
+        Entry &entry = _entries[queryKey];
+        entry.rows = rows;
+        entry.lastUsed = ++_clock;
+        _bytes += size;
+    }
+
+    /** Returns a string that uniquely identifies a query's options, for use as a cache key. */
+    static std::string keyFor(const C4QueryOptions *o) {
+        std::string key;
+        addInt(key, o->skip);
+        addInt(key, o->limit);
+        addInt(key, o->descending | (o->inclusiveStart << 1) | (o->inclusiveEnd << 2)
+                    | ((o->startKeyDocID.buf != NULL) << 3) | ((o->endKeyDocID.buf != NULL) << 4)
+                    | (o->group << 5));
+        addInt(key, o->reduce);
+        addInt(key, o->groupLevel);
+        addSlice(key, o->startKey ? (slice)*o->startKey : slice::null);
+        addSlice(key, o->endKey ? (slice)*o->endKey : slice::null);
+        addSlice(key, o->startKeyDocID);
+        addSlice(key, o->endKeyDocID);
+        addInt(key, o->keys ? o->keysCount : 0);
+        for (size_t i = 0; o->keys && i < o->keysCount; ++i)
+            addSlice(key, o->keys[i] ? (slice)*o->keys[i] : slice::null);
+        return key;
+    }
+
+    /** Appends a row to an encoded result: the lengths and bytes of key, value and docID, then
+        the sequence, all lengths and numbers being varints. */
+    static void appendRow(std::string &rows, const C4QueryEnumerator *row) {
+        addSlice(rows, slice(row->key.bytes, row->key.length));
+        addSlice(rows, row->value);
+        addSlice(rows, row->docID);
+        addInt(rows, row->docSequence);
+    }
+
+    /** Reads the next row from an encoded result, advancing the slice past it. */
+    static bool readRow(slice &rows, C4QueryEnumerator *row) {
+        slice key, value, docID;
+        uint64_t seq;
+        if (!readSlice(rows, key) || !readSlice(rows, value) || !readSlice(rows, docID)
+                                  || !ReadUVarInt(&rows, &seq))
+            return false;
+        row->key = {key.buf, key.size};
+        row->value = value;
+        row->docID = docID;
+        row->docSequence = seq;
+        return true;
+    }
+
+private:
+    struct Entry {
+        Rows rows;
+        uint64_t lastUsed;
+    };
+
+    static size_t entrySize(const std::string &queryKey, const std::string &rows) {
+        return queryKey.size() + rows.size() + sizeof(Entry);
+    }
+
+    // Removes least-recently-used entries until there's room for `size` more bytes.
+    void evict(size_t size) {
+        while (!_entries.empty() && _bytes + size > _maxBytes) {
+            auto oldest = _entries.begin();
+            for (auto i = _entries.begin(); i != _entries.end(); ++i)
+                if (i->second.lastUsed < oldest->second.lastUsed)
+                    oldest = i;
+            _bytes -= entrySize(oldest->first, *oldest->second.rows);
+            _entries.erase(oldest);
+        }
+    }
+
+    static void addInt(std::string &str, uint64_t n) {
+        uint8_t buf[kMaxVarintLen64];
+        str.append((const char*)buf, PutUVarInt(buf, n));
+    }
+
+    static void addSlice(std::string &str, slice s) {
+        addInt(str, s.size);
+        if (s.size > 0)
+            str.append((const char*)s.buf, s.size);
+    }
+
+    static bool readSlice(slice &data, slice &s) {
+        uint64_t size;
+        if (!ReadUVarInt(&data, &size) || size > data.size)
+            return false;
+        s = slice(data.buf, (size_t)size);
+        data.moveStart((size_t)size);
+        return true;
+    }
+
+    std::mutex _mutex;
+    size_t _maxBytes, _bytes;
+    sequence _changedAt;        // lastSequenceChangedAt of the index when the entries were made
+    uint64_t _clock;
+    std::unordered_map<std::string, Entry> _entries;
+};
+
+
 #pragma mark - VIEWS:
 
 
+// Views opened on the same file (through the same source database handle) share a Database, so
+// that an indexer can update all of them in a single transaction.
+static std::mutex sViewDBsMutex;
+static std::map<std::pair<C4Database*, std::string>, std::weak_ptr<Database> > sViewDBs;
+
+static std::shared_ptr<Database> openViewDatabase(C4Database *sourceDB,
+                                                  std::string path,
+                                                  const Database::config &config)
+{
+    std::lock_guard<std::mutex> lock(sViewDBsMutex);
+    std::shared_ptr<Database> db = sViewDBs[std::make_pair(sourceDB, path)].lock();
+    if (!db) {
+        for (auto i = sViewDBs.begin(); i != sViewDBs.end(); ) {
+            if (i->second.expired())
+                i = sViewDBs.erase(i);
+            else
+                ++i;
+        }
+        db = std::make_shared<Database>(path, config);
+        sViewDBs[std::make_pair(sourceDB, path)] = db;
+    }
+    return db;
+}
+
+
 struct c4View {
     c4View(C4Database *sourceDB,
            C4Slice path,
@@ -121,19 +305,41 @@ struct c4View {
            const Database::config &config,
            C4Slice version)
     :_sourceDB(sourceDB),
-     _viewDB((std::string)path, config),
-     _index(&_viewDB, (std::string)name, asDatabase(sourceDB)->defaultKeyStore())
+     _viewDB(openViewDatabase(sourceDB, (std::string)path, config)),
+     _index(_viewDB.get(), (std::string)name, asDatabase(sourceDB)->defaultKeyStore()),
+     _backgroundIndexer(NULL),
+     _hasFilter(false),
+     _filterByDocType(false),
+     _filterOnlyConflicted(false)
     {
-        Transaction t(&_viewDB);
-        _index.setup(t, -1, NULL, (std::string)version);
+        Transaction t(_viewDB.get());
+        _index.setup(t, -1, NULL, (std::string)version, _index.aggregateLevels());
+    }
+
+    /** Applies the document filter (see c4view_setDocumentFilter) to a document's metadata. */
+    bool acceptsDocument(C4DocumentFlags flags, slice docType) const {
+        if (!_hasFilter)
+            return true;
+        if (flags & kDeleted)
+            return false;
+        if (_filterOnlyConflicted && !(flags & kConflicted))
+            return false;
+        return !_filterByDocType || docType == slice(_filterDocType);
     }
 
     C4Database *_sourceDB;
-    Database _viewDB;
+    std::shared_ptr<Database> _viewDB;          // Shared with other views in the same file
     MapReduceIndex _index;
+    QueryCache _queryCache;
+    C4BackgroundIndexer *_backgroundIndexer;    // Set by c4bgindexer_addView
+    bool _hasFilter, _filterByDocType, _filterOnlyConflicted;
+    std::string _filterDocType;
 };
 
 
+static void removeFromBackgroundIndexer(C4View*);
+
+
 C4View* c4view_open(C4Database* db,
                     C4Slice path,
                     C4Slice viewName,
@@ -155,6 +361,7 @@ C4View* c4view_open(C4Database* db,
 /** Closes the view and frees the object. */
 bool c4view_close(C4View* view, C4Error *outError) {
     try {
+        removeFromBackgroundIndexer(view);
         delete view;
         return true;
     } catchError(outError);
@@ -162,25 +369,52 @@ bool c4view_close(C4View* view, C4Error *outError) {
 }
 
 bool c4view_rekey(C4View *view, const C4EncryptionKey *newKey, C4Error *outError) {
-    return c4RekeyInternal(&view->_viewDB, newKey, outError);
+    return c4RekeyInternal(view->_viewDB.get(), newKey, outError);
+}
+
+void c4view_setDocumentFilter(C4View *view, C4Slice docType, bool onlyConflicted) {
+    view->_filterByDocType = (docType.buf != NULL);
+    view->_filterDocType = view->_filterByDocType ? (std::string)docType : std::string();
+    view->_filterOnlyConflicted = onlyConflicted;
+    view->_hasFilter = true;
+    view->_queryCache.clear();
 }
 
 bool c4view_eraseIndex(C4View *view, C4Error *outError) {
     try {
-        Transaction t(&view->_viewDB);
+        Transaction t(view->_viewDB.get());
         view->_index.erase(t);
+        view->_queryCache.clear();
+        return true;
+    } catchError(outError);
+    return false;
+}
+
+bool c4view_setAggregateLevels(C4View *view, unsigned levels, C4Error *outError) {
+    try {
+        Transaction t(view->_viewDB.get());
+        view->_index.setAggregateLevels(t, levels);
+        view->_queryCache.clear();     // the index may have been erased
         return true;
     } catchError(outError);
     return false;
 }
 
+void c4view_setQueryCacheSize(C4View *view, size_t maxBytes) {
+    view->_queryCache.setMaxBytes(maxBytes);
+}
+
 bool c4view_delete(C4View *view, C4Error *outError) {
     try {
 		if (view == NULL) {
 			return true;
 		}
 
-        view->_viewDB.deleteDatabase();
+        removeFromBackgroundIndexer(view);
+        if (view->_viewDB.use_count() > 1)
+            view->_index.deleteStores();    // other views are still using the file
+        else
+            view->_viewDB->deleteDatabase();
         delete view;
         return true;
     } catchError(outError)
@@ -221,7 +455,48 @@ struct c4Indexer : public MapReduceIndexer {
 
     virtual ~c4Indexer() { }
 
+    void addView(C4View *view, Transaction *t) {
+        addIndex(&view->_index, t);
+        _views.push_back(view);
+    }
+
+    bool hasFilters() const {
+        for (auto v = _views.begin(); v != _views.end(); ++v)
+            if ((*v)->_hasFilter)
+                return true;
+        return false;
+    }
+
+    // Called by the filtered enumerator with each document's metadata. Views that reject the
+    // document get an empty update right away (removing any rows it used to have, and advancing
+    // their lastSequenceIndexed); returns true if any view still needs the document itself.
+    bool filterDocument(slice docID, sequence seq, C4DocumentFlags flags, slice docType) {
+        _filteredDocID.assign((const char*)docID.buf, docID.size);
+        _filteredOut.assign(_views.size(), false);
+        bool wanted = false;
+        for (unsigned i = 0; i < _views.size(); ++i) {
+            if (!viewNeedsSequence(i, seq)) {
+                _filteredOut[i] = true;
+            } else if (_views[i]->acceptsDocument(flags, docType)) {
+                wanted = true;
+            } else {
+                _filteredOut[i] = true;
+                emitDocIntoView(docID, seq, i, std::vector<Collatable>(), std::vector<alloc_slice>());
+            }
+        }
+        return wanted;
+    }
+
+    bool shouldIndex(const C4Document *doc, unsigned viewNumber) const {
+        if (viewNumber < _filteredOut.size() && slice(doc->docID) == slice(_filteredDocID))
+            return !_filteredOut[viewNumber];
+        return viewNeedsSequence(viewNumber, doc->sequence);
+    }
+
     C4Database* _db;
+    std::vector<C4View*> _views;
+    std::string _filteredDocID;     // ID of the document last passed to filterDocument
+    std::vector<bool> _filteredOut; // Views that have already handled that document
 };
 
 
@@ -233,9 +508,13 @@ C4Indexer* c4indexer_begin(C4Database *db,
     c4Indexer *indexer = NULL;
     try {
         indexer = new c4Indexer(db);
+        // Views sharing a file are updated in one transaction, and committed together:
+        std::map<Database*, Transaction*> transactions;
         for (int i = 0; i < viewCount; ++i) {
-            auto t = new Transaction(&views[i]->_viewDB);
-            indexer->addIndex(&views[i]->_index, t);
+            Transaction* &t = transactions[views[i]->_viewDB.get()];
+            if (!t)
+                t = new Transaction(views[i]->_viewDB.get());
+            indexer->addView(views[i], t);
         }
         return indexer;
     } catchError(outError);
@@ -254,11 +533,23 @@ C4DocEnumerator* c4indexer_enumerateDocuments(C4Indexer *indexer, C4Error *outEr
         }
         auto options = kC4DefaultEnumeratorOptions;
         options.flags |= kC4IncludeDeleted;
+        if (indexer->hasFilters()) {
+            // Check the views' filters against each doc's metadata before reading its body:
+            options.flags &= ~kC4IncludeBodies;
+            return c4EnumerateChangesFiltered(indexer->_db, startSequence-1, options,
+                            [indexer](slice docID, sequence seq, C4DocumentFlags flags, slice type) {
+                                return indexer->filterDocument(docID, seq, flags, type);
+                            });
+        }
         return c4db_enumerateChanges(indexer->_db, startSequence-1, &options, outError);
     } catchError(outError);
     return NULL;
 }
 
+bool c4indexer_shouldIndex(C4Indexer *indexer, C4Document *doc, unsigned viewNumber) {
+    return indexer->shouldIndex(doc, viewNumber);
+}
+
 bool c4indexer_emit(C4Indexer *indexer,
                     C4Document *doc,
                     unsigned viewIndex,
@@ -268,15 +559,60 @@ bool c4indexer_emit(C4Indexer *indexer,
                     C4Error *outError)
 {
     try {
+        if (!indexer->shouldIndex(doc, viewIndex))
+            return true;    // already handled (e.g. rejected by the view's filter)
         std::vector<Collatable> keys;
-        std::vector<slice> values;
+        std::vector<alloc_slice> values;
         if (!(doc->flags & kDeleted)) {
+            keys.reserve(emitCount);
+            values.reserve(emitCount);
             for (unsigned i = 0; i < emitCount; ++i) {
                 keys.push_back(*emittedKeys[i]);
-                values.push_back(emittedValues[i]);
+                values.push_back(alloc_slice(emittedValues[i]));
             }
         }
-        indexer->emitDocIntoView(doc->docID, doc->sequence, viewIndex, keys, values);
+        indexer->emitDocIntoView(doc->docID, doc->sequence, viewIndex,
+                                 std::move(keys), std::move(values));
+        return true;
+    } catchError(outError)
+    return false;
+}
+
+bool c4indexer_emitBatch(C4Indexer *indexer,
+                         unsigned viewNumber,
+                         unsigned docCount,
+                         C4Document* documents[],
+                         const unsigned emitCounts[],
+                         const C4Key *emittedKeys,
+                         const C4Slice emittedValues[],
+                         C4Error *outError)
+{
+    try {
+        // The keys are packed one after another, so read them off in order:
+        CollatableReader keyReader(emittedKeys ? (slice)*emittedKeys : slice::null);
+        const C4Slice *value = emittedValues;
+        for (unsigned d = 0; d < docCount; ++d) {
+            C4Document *doc = documents[d];
+            unsigned emitCount = emitCounts[d];
+            bool wanted = indexer->shouldIndex(doc, viewNumber);
+            bool emitting = wanted && !(doc->flags & kDeleted);
+            std::vector<Collatable> keys;
+            std::vector<alloc_slice> values;
+            if (emitting) {
+                keys.reserve(emitCount);
+                values.reserve(emitCount);
+            }
+            for (unsigned i = 0; i < emitCount; ++i, ++value) {
+                slice key = keyReader.read();
+                if (emitting) {
+                    keys.push_back(Collatable(key, true));
+                    values.push_back(alloc_slice(*value));
+                }
+            }
+            if (wanted)
+                indexer->emitDocIntoView(doc->docID, doc->sequence, viewNumber,
+                                         std::move(keys), std::move(values));
+        }
         return true;
     } catchError(outError)
     return false;
@@ -294,6 +630,242 @@ bool c4indexer_end(C4Indexer *indexer, bool commit, C4Error *outError) {
 }
 
 
+#pragma mark - BACKGROUND INDEXING:
+
+
+struct c4BackgroundIndexer {
+
+    c4BackgroundIndexer(C4Database *db, float cpuFraction, unsigned batchSize)
+    :_clientDB(db),
+     _db(c4dbOpenAgain(db)),
+     _cpuFraction(cpuFraction),
+     _batchSize(batchSize),
+     _requested(1),         // so the thread indexes whatever's pending as soon as it starts
+     _completed(0),
+     _waiters(0),
+     _stopping(false)
+    {
+        c4dbAddCommitObserver(_clientDB, this, [this]{ request(); });
+        _thread = std::thread(&c4BackgroundIndexer::run, this);
+    }
+
+    ~c4BackgroundIndexer() {
+        c4dbRemoveCommitObservers(_clientDB, this);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+            _wake.notify_all();
+            _done.notify_all();
+        }
+        _thread.join();
+        for (auto r = _views.begin(); r != _views.end(); ++r)
+            (*r)->clientView->_backgroundIndexer = NULL;
+        _views.clear();
+        c4db_close(_db, NULL);
+    }
+
+    void addView(C4View *view, C4MapCallback map, void *context) {
+        // Open the indexer's own handle on the view, since the client's can't be shared:
+        std::string path = view->_viewDB->filename(), name = view->_index.name();
+        std::string version = view->_index.mapVersion();
+        RegistrationRef reg = std::make_shared<Registration>();
+        reg->clientView = view;
+        {
+            // Opening the view uses _db, which the indexer thread may be using for a batch:
+            std::lock_guard<std::mutex> batchLock(_batchMutex);
+            reg->view.reset(new c4View(_db, slice(path), slice(name), view->_viewDB->getConfig(),
+                                       slice(version)));
+        }
+        reg->view->_hasFilter = view->_hasFilter;
+        reg->view->_filterByDocType = view->_filterByDocType;
+        reg->view->_filterDocType = view->_filterDocType;
+        reg->view->_filterOnlyConflicted = view->_filterOnlyConflicted;
+        reg->map = map;
+        reg->context = context;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _views.push_back(reg);
+        }
+        view->_backgroundIndexer = this;
+        request();
+    }
+
+    void removeView(C4View *view) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            for (auto r = _views.begin(); r != _views.end(); ++r) {
+                if ((*r)->clientView == view) {
+                    _views.erase(r);
+                    break;
+                }
+            }
+        }
+        // Wait for any batch in progress, which may still be using the view's files:
+        std::lock_guard<std::mutex> batchLock(_batchMutex);
+        view->_backgroundIndexer = NULL;
+    }
+
+    /** Asks the indexer thread to bring the views up to date. Returns immediately. */
+    uint64_t request() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _wake.notify_all();
+        return ++_requested;
+    }
+
+    /** Asks the indexer thread to bring the views up to date, and waits until it has. */
+    void waitForUpdate() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        uint64_t generation = ++_requested;
+        ++_waiters;
+        _wake.notify_all();
+        _done.wait(lock, [&]{return _completed >= generation || _stopping;});
+        --_waiters;
+    }
+
+private:
+    struct Registration {
+        C4View *clientView;                 // The client's view handle
+        std::unique_ptr<c4View> view;       // The indexer's own handle on the same view
+        C4MapCallback map;
+        void *context;
+    };
+    typedef std::shared_ptr<Registration> RegistrationRef;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true) {
+            _wake.wait(lock, [this]{return _stopping || _completed < _requested;});
+            if (_stopping)
+                break;
+            // Every request made up to now is satisfied by indexing everything committed so far,
+            // so commits made while the previous pass ran are handled in one pass:
+            uint64_t generation = _requested;
+            bool more;
+            do {
+                lock.unlock();
+                auto startTime = std::chrono::steady_clock::now();
+                more = indexBatch();
+                auto elapsed = std::chrono::steady_clock::now() - startTime;
+                lock.lock();
+                if (more && _waiters == 0 && _cpuFraction < 1.0) {
+                    // Stay within the CPU budget by idling in proportion to the time just spent:
+                    auto pause = elapsed * ((1.0 - _cpuFraction) / _cpuFraction);
+                    _wake.wait_for(lock, pause, [this]{return _stopping || _waiters > 0;});
+                }
+            } while (more && !_stopping);
+            _completed = generation;
+            _done.notify_all();
+        }
+    }
+
+    // Indexes up to _batchSize documents in one transaction. Returns true if there may be more.
+    bool indexBatch() {
+        std::lock_guard<std::mutex> batchLock(_batchMutex);
+        std::vector<RegistrationRef> regs;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            regs = _views;
+        }
+        if (regs.empty())
+            return false;
+
+        std::vector<C4View*> views;
+        for (auto r = regs.begin(); r != regs.end(); ++r)
+            views.push_back((*r)->view.get());
+
+        C4Error error = {};
+        C4Indexer *indexer = c4indexer_begin(_db, &views[0], (int)views.size(), &error);
+        if (!indexer) {
+            Warn("Background indexer couldn't start indexing (error %d/%d)",
+                 error.domain, error.code);
+            return false;
+        }
+        bool ok = true, more = false;
+        C4DocEnumerator *e = c4indexer_enumerateDocuments(indexer, &error);
+        if (e) {
+            unsigned count = 0;
+            C4Document *doc;
+            while (NULL != (doc = c4enum_nextDocument(e, &error))) {
+                for (unsigned i = 0; i < regs.size() && ok; ++i) {
+                    if (c4indexer_shouldIndex(indexer, doc, i))
+                        ok = regs[i]->map(regs[i]->context, indexer, doc, i, &error);
+                }
+                c4doc_free(doc);
+                if (!ok)
+                    break;
+                if (++count >= _batchSize) {
+                    more = true;
+                    break;
+                }
+            }
+            if (ok && !more && error.code != 0)
+                ok = false;
+            c4enum_free(e);
+        } else if (error.code != 0) {
+            ok = false;
+        }
+        if (!ok) {
+            Warn("Background indexing failed (error %d/%d)", error.domain, error.code);
+        }
+        c4indexer_end(indexer, ok, NULL);
+        return more;
+    }
+
+    C4Database* const _clientDB;
+    C4Database* const _db;              // The indexer's own handle on the database
+    const float _cpuFraction;
+    const unsigned _batchSize;
+    std::vector<RegistrationRef> _views;
+    std::thread _thread;
+    std::mutex _mutex;                  // Protects all the following state
+    std::mutex _batchMutex;             // Held while indexing a batch
+    std::condition_variable _wake, _done;
+    uint64_t _requested, _completed;    // Generations of requests made and satisfied
+    unsigned _waiters;
+    bool _stopping;
+};
+
+
+static void removeFromBackgroundIndexer(C4View *view) {
+    if (view && view->_backgroundIndexer)
+        view->_backgroundIndexer->removeView(view);
+}
+
+
+C4BackgroundIndexer* c4bgindexer_start(C4Database *db,
+                                       float cpuFraction,
+                                       unsigned batchSize,
+                                       C4Error *outError)
+{
+    try {
+        if (!(cpuFraction > 0.0 && cpuFraction <= 1.0))
+            cpuFraction = 1.0;
+        return new c4BackgroundIndexer(db, cpuFraction, std::max(batchSize, 1u));
+    } catchError(outError);
+    return NULL;
+}
+
+bool c4bgindexer_addView(C4BackgroundIndexer *indexer,
+                         C4View *view,
+                         C4MapCallback map,
+                         void *context,
+                         C4Error *outError)
+{
+    try {
+        removeFromBackgroundIndexer(view);
+        indexer->addView(view, map, context);
+        return true;
+    } catchError(outError);
+    return false;
+}
+
+void c4bgindexer_stop(C4BackgroundIndexer *indexer) {
+    try {
+        delete indexer;
+    } catchError(NULL);
+}
+
+
 #pragma mark - QUERIES:
 
 
@@ -302,16 +874,132 @@ struct C4QueryEnumInternal : public C4QueryEnumerator {
                         Collatable startKey, slice startKeyDocID,
                         Collatable endKey, slice endKeyDocID,
                         const DocEnumerator::Options &options)
-    :_enum(&view->_index, startKey, startKeyDocID, endKey, endKeyDocID, options)
+    :_enum(new IndexEnumerator(&view->_index, startKey, startKeyDocID,
+                               endKey, endKeyDocID, options))
     { }
 
     C4QueryEnumInternal(C4View *view,
                         std::vector<KeyRange> keyRanges,
                         const DocEnumerator::Options &options)
-    :_enum(&view->_index, keyRanges, options)
+    :_enum(new IndexEnumerator(&view->_index, keyRanges, options, true))
+    { }
+
+    // Reduces from the index's aggregates, without enumerating rows:
+    C4QueryEnumInternal(ReduceEnumerator *reducer)
+    :_reducer(reducer)
+    { }
+
+    // Replays results from the view's query cache:
+    C4QueryEnumInternal(QueryCache::Rows cachedRows)
+    :_cachedRows(cachedRows),
+     _cachedRemaining(*cachedRows)
     { }
 
-    IndexEnumerator _enum;
+    // Rows being collected for the view's query cache; they're added to it once the enumeration
+    // completes (unless the index changed meanwhile, or they outgrow the cache.)
+    struct Recording {
+        C4View *view;
+        std::string queryKey;
+        sequence changedAt;
+        std::string rows;
+    };
+
+    void recordRow() {
+        QueryCache::appendRow(_recording->rows, this);
+        if (_recording->rows.size() > _recording->view->_queryCache.maxBytes())
+            _recording.reset();
+    }
+
+    void finishRecording() {
+        C4View *view = _recording->view;
+        if (view->_index.lastSequenceChangedAt() == _recording->changedAt) {
+            auto rows = std::make_shared<const std::string>(std::move(_recording->rows));
+            view->_queryCache.put(_recording->queryKey, _recording->changedAt, rows);
+        }
+        _recording.reset();
+    }
+
+    // With includeDocs, reads up to kDocBatchSize rows ahead, then fetches all their documents
+    // in one pass in docID order, instead of one random lookup per row:
+    static const size_t kDocBatchSize = 50;
+
+    struct DocRow {
+        alloc_slice key, value, docID;
+        sequence docSequence;
+        alloc_slice revID, body;
+    };
+
+    void includeDocs(KeyStore sourceStore) {
+        _sourceStore = sourceStore;
+        _includeDocs = true;
+    }
+
+    bool nextWithDoc() {
+        if (_docRowIndex >= _docRows.size()) {
+            readDocRows();
+            if (_docRows.empty())
+                return false;
+        }
+        const DocRow &row = _docRows[_docRowIndex++];
+        key = asKeyReader(CollatableReader(row.key));
+        value = row.value;
+        docID = row.docID;
+        docSequence = row.docSequence;
+        docRevID = row.revID;
+        docBody = row.body;
+        return true;
+    }
+
+    void readDocRows() {
+        // The vectors are reused from batch to batch:
+        _docRows.clear();
+        _docRowIndex = 0;
+        _docIDs.clear();
+        while (_docRows.size() < kDocBatchSize && _enum->next()) {
+            DocRow row;
+            row.key = alloc_slice(_enum->key().data());
+            row.value = alloc_slice(_enum->value());
+            row.docID = alloc_slice(_enum->docID());
+            row.docSequence = _enum->sequence();
+            _docIDs.push_back((std::string)row.docID);
+            _docRows.push_back(std::move(row));
+        }
+        if (_docIDs.empty())
+            return;
+
+        std::sort(_docIDs.begin(), _docIDs.end());
+        _docIDs.erase(std::unique(_docIDs.begin(), _docIDs.end()), _docIDs.end());
+        std::unordered_map<std::string, std::pair<alloc_slice, alloc_slice>> docs;
+        for (DocEnumerator e(_sourceStore, _docIDs); e.next(); ) {
+            VersionedDocument vdoc(_sourceStore, e.doc());
+            if (!vdoc.exists())
+                continue;
+            auto &doc = docs[(std::string)vdoc.docID()];
+            doc.first = vdoc.revID().expanded();
+            const Revision *rev = vdoc.currentRevision();
+            if (rev && !rev->isDeleted())
+                doc.second = rev->readBody();
+        }
+        for (auto row = _docRows.begin(); row != _docRows.end(); ++row) {
+            auto doc = docs.find((std::string)row->docID);
+            if (doc != docs.end()) {
+                row->revID = doc->second.first;
+                row->body = doc->second.second;
+            }
+        }
+    }
+
+    std::unique_ptr<IndexEnumerator> _enum;
+    std::unique_ptr<ReduceEnumerator> _reducer;
+    QueryCache::Rows _cachedRows;
+    slice _cachedRemaining;
+    std::unique_ptr<Recording> _recording;
+
+    bool _includeDocs {false};
+    KeyStore _sourceStore;
+    std::vector<DocRow> _docRows;
+    size_t _docRowIndex {0};
+    std::vector<std::string> _docIDs;
 };
 
 static C4QueryEnumInternal* asInternal(C4QueryEnumerator *e) {return (C4QueryEnumInternal*)e;}
@@ -333,21 +1021,71 @@ C4QueryEnumerator* c4view_query(C4View *view,
     try {
         if (!c4options)
             c4options = &kC4DefaultQueryOptions;
+
+        if (c4options->stale == kC4UpdateBefore && view->_backgroundIndexer)
+            view->_backgroundIndexer->waitForUpdate();
+
+        // Check for cached results of an identical query. (Not when including docs, which can
+        // change without the index changing.)
+        bool reducing = (c4options->reduce != kC4NoReduce);
+        bool includeDocs = c4options->includeDocs && !reducing;
+        std::unique_ptr<C4QueryEnumInternal::Recording> recording;
+        if (view->_queryCache.maxBytes() > 0 && !includeDocs) {
+            recording.reset(new C4QueryEnumInternal::Recording);
+            recording->view = view;
+            recording->queryKey = QueryCache::keyFor(c4options);
+            recording->changedAt = view->_index.lastSequenceChangedAt();
+            auto rows = view->_queryCache.get(recording->queryKey, recording->changedAt);
+            if (rows) {
+                if (c4options->stale == kC4UpdateAfter && view->_backgroundIndexer)
+                    view->_backgroundIndexer->request();
+                return new C4QueryEnumInternal(rows);
+            }
+        }
+
         DocEnumerator::Options options = DocEnumerator::Options::kDefault;
         options.skip = (unsigned)c4options->skip;
         options.limit = (unsigned)c4options->limit;
         options.descending = c4options->descending;
         options.inclusiveStart = c4options->inclusiveStart;
         options.inclusiveEnd = c4options->inclusiveEnd;
+        if (reducing) {
+            // Skip and limit apply to the reduced rows, not the index rows:
+            options.skip = DocEnumerator::Options::kDefault.skip;
+            options.limit = DocEnumerator::Options::kDefault.limit;
+        }
 
+        ReduceEnumerator::ReduceType reduceType = ReduceEnumerator::kCount;
+        switch (c4options->reduce) {
+            case kC4NoReduce:    break;
+            case kC4ReduceCount: reduceType = ReduceEnumerator::kCount; break;
+            case kC4ReduceSum:   reduceType = ReduceEnumerator::kSum; break;
+            case kC4ReduceStats: reduceType = ReduceEnumerator::kStats; break;
+        }
+
+        C4QueryEnumInternal *e;
         if (c4options->keysCount == 0 && c4options->keys == NULL) {
             Collatable noKey;
-            return new C4QueryEnumInternal(view,
-                                           (c4options->startKey ? *c4options->startKey : noKey),
-                                           c4options->startKeyDocID,
-                                           (c4options->endKey ? *c4options->endKey : noKey),
-                                           c4options->endKeyDocID,
-                                           options);
+            Collatable startKey = (c4options->startKey ? *c4options->startKey : noKey);
+            Collatable endKey = (c4options->endKey ? *c4options->endKey : noKey);
+            if (reducing && c4options->startKeyDocID.buf == NULL
+                         && c4options->endKeyDocID.buf == NULL
+                         && ReduceEnumerator::canUseAggregates(&view->_index, reduceType,
+                                                               c4options->group,
+                                                               c4options->groupLevel)) {
+                // The view's aggregates can do this reduce without reading most of the rows:
+                options.skip = (unsigned)c4options->skip;
+                options.limit = (unsigned)c4options->limit;
+                e = new C4QueryEnumInternal(new ReduceEnumerator(&view->_index,
+                                                                 startKey, endKey, options,
+                                                                 reduceType,
+                                                                 c4options->groupLevel));
+            } else {
+                e = new C4QueryEnumInternal(view,
+                                            startKey, c4options->startKeyDocID,
+                                            endKey, c4options->endKeyDocID,
+                                            options);
+            }
         } else {
             std::vector<KeyRange> keyRanges;
             for (int i = 0; i < c4options->keysCount; i++) {
@@ -355,32 +1093,122 @@ C4QueryEnumerator* c4view_query(C4View *view,
                 if (key)
                     keyRanges.push_back(KeyRange(*key));
             }
-            return new C4QueryEnumInternal(view, keyRanges, options);
+            e = new C4QueryEnumInternal(view, keyRanges, options);
         }
+
+        if (reducing && !e->_reducer) {
+            e->_reducer.reset(new ReduceEnumerator(*e->_enum, reduceType,
+                                                   c4options->group, c4options->groupLevel,
+                                                   (unsigned)c4options->skip,
+                                                   (unsigned)c4options->limit));
+        }
+        if (includeDocs)
+            e->includeDocs(view->_index.sourceStore());
+        e->_recording = std::move(recording);
+        // Now that the enumerator is positioned, the index can be updated behind its back:
+        if (c4options->stale == kC4UpdateAfter && view->_backgroundIndexer)
+            view->_backgroundIndexer->request();
+        return e;
     } catchError(outError);
     return NULL;
 }
 
 
+uint64_t c4view_countRows(C4View *view,
+                          const C4QueryOptions *c4options,
+                          C4Error *outError)
+{
+    try {
+        if (!c4options)
+            c4options = &kC4DefaultQueryOptions;
+        if (c4options->stale == kC4UpdateBefore && view->_backgroundIndexer)
+            view->_backgroundIndexer->waitForUpdate();
+        else if (c4options->stale == kC4UpdateAfter && view->_backgroundIndexer)
+            view->_backgroundIndexer->request();    // (it doesn't matter if it's first)
+        bool hasKeys = (c4options->keysCount > 0 || c4options->keys != NULL);
+        if (!hasKeys && !c4options->startKey && !c4options->endKey && c4options->skip == 0) {
+            // Counting the whole index; the index already knows how many rows it has:
+            return std::min(view->_index.rowCount(), c4options->limit);
+        }
+
+        DocEnumerator::Options options = DocEnumerator::Options::kDefault;
+        options.skip = (unsigned)c4options->skip;
+        options.limit = (unsigned)c4options->limit;
+        options.descending = c4options->descending;
+        options.inclusiveStart = c4options->inclusiveStart;
+        options.inclusiveEnd = c4options->inclusiveEnd;
+        options.contentOptions = KeyStore::kMetaOnly;    // only the keys are needed
+
+        std::unique_ptr<IndexEnumerator> e;
+        if (!hasKeys) {
+            Collatable noKey;
+            e.reset(new IndexEnumerator(&view->_index,
+                                        (c4options->startKey ? *c4options->startKey : noKey),
+                                        c4options->startKeyDocID,
+                                        (c4options->endKey ? *c4options->endKey : noKey),
+                                        c4options->endKeyDocID,
+                                        options));
+        } else {
+            std::vector<KeyRange> keyRanges;
+            for (int i = 0; i < c4options->keysCount; i++) {
+                const C4Key* key = c4options->keys[i];
+                if (key)
+                    keyRanges.push_back(KeyRange(*key));
+            }
+            e.reset(new IndexEnumerator(&view->_index, keyRanges, options));
+        }
+        uint64_t count = 0;
+        while (e->next())
+            ++count;
+        recordError(FDB_RESULT_SUCCESS, outError);
+        return count;
+    } catchError(outError);
+    return 0;
+}
+
+
 bool c4queryenum_next(C4QueryEnumerator *e,
                       C4Error *outError)
 {
     try {
         auto ei = asInternal(e);
-        if (ei->_enum.next()) {
-            ei->key = asKeyReader(ei->_enum.key());
-            ei->value = ei->_enum.value();
-            ei->docID = ei->_enum.docID();
-            ei->docSequence = ei->_enum.sequence();
-            return true;
+        ei->docRevID = ei->docBody = slice::null;
+        bool found;
+        if (ei->_includeDocs) {
+            found = ei->nextWithDoc();
+        } else if (ei->_cachedRows) {
+            found = QueryCache::readRow(ei->_cachedRemaining, ei);
+        } else if (ei->_reducer) {
+            found = ei->_reducer->next();
+            if (found) {
+                ei->key = asKeyReader(ei->_reducer->key());
+                ei->value = ei->_reducer->value();
+                ei->docID = slice::null;
+                ei->docSequence = 0;
+            }
         } else {
-            ei->key = {NULL, 0};
-            ei->value = slice::null;
-            ei->docID = slice::null;
-            ei->docSequence = 0;
-            recordError(FDB_RESULT_SUCCESS, outError);      // end of iteration is not an error
-            return false;
+            found = ei->_enum->next();
+            if (found) {
+                ei->key = asKeyReader(ei->_enum->key());
+                ei->value = ei->_enum->value();
+                ei->docID = ei->_enum->docID();
+                ei->docSequence = ei->_enum->sequence();
+            }
+        }
+        if (found) {
+            if (ei->_recording)
+                ei->recordRow();
+            return true;
         }
+        if (ei->_recording)
+            ei->finishRecording();
+
+        ei->key = {NULL, 0};
+        ei->value = slice::null;
+        ei->docID = slice::null;
+        ei->docSequence = 0;
+        recordError(FDB_RESULT_SUCCESS, outError);      // end of iteration is not an error
+        return false;
     } catchError(outError);
     return false;
 }
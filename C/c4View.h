@@ -112,6 +112,9 @@ extern "C" {
     typedef struct c4View C4View;
 
     /** Opens a view, or creates it if the file doesn't already exist.
+        Any number of views (with different names) can be stored in the same file. Views of one
+        database that are opened with the same path share a single file handle, cache and WAL,
+        and an indexer updates all of them in a single transaction.
         @param database  The database the view is associated with.
         @param path  The filesystem path to the view index file.
         @param viewName  The name of the view.
@@ -129,15 +132,43 @@ extern "C" {
     /** Closes the view and frees the object. */
     bool c4view_close(C4View* view, C4Error*);
 
-    /** Changes a view's encryption key (removing encryption if it's NULL.) */
+    /** Changes a view's encryption key (removing encryption if it's NULL.)
+        This applies to the whole file, including any other views stored in it. */
     bool c4view_rekey(C4View*,
                       const C4EncryptionKey *newKey,
                       C4Error *outError);
 
+    /** Restricts the documents a view indexes, using information the indexer can check without
+        reading document bodies. Deleted documents and documents that don't match are indexed
+        as though the map function emitted nothing, without being read or passed to it.
+        Like the map function, the filter isn't stored in the index, so changing it calls for
+        changing the view's version. Set it before indexing or adding the view to a background
+        indexer.
+        @param view  The view.
+        @param docType  If not null, only documents with this type (see c4doc_setType) match.
+        @param onlyConflicted  If true, only documents in conflict match. */
+    void c4view_setDocumentFilter(C4View *view, C4Slice docType, bool onlyConflicted);
+
     /** Erases the view index, but doesn't delete the database file. */
     bool c4view_eraseIndex(C4View*, C4Error *outError);
 
-    /** Deletes the database file and closes/frees the C4View. */
+    /** Makes the index maintain running counts and sums of its rows, grouped by the first 1 to
+        `levels` items of their (array) keys. Count and sum reduce queries with a groupLevel up to
+        `levels` then add up these totals instead of reading most of the rows in the range.
+        (Totals are kept for key prefixes up to 8 encoded bytes long, i.e. about 7 characters of
+        a string, so the rows at either end of a range whose keys share that much with the end
+        key are still read one by one.)
+        Changing the number of levels erases the index. (The default is 0, i.e. none.) */
+    bool c4view_setAggregateLevels(C4View*, unsigned levels, C4Error *outError);
+
+    /** Enables caching of query results, up to the given total size in bytes (0 disables it,
+        which is the default.) A query whose options are identical to an earlier one's, made while
+        the index hasn't changed since, then replays the earlier results instead of reading the
+        index. Only queries that were enumerated to the end are cached. */
+    void c4view_setQueryCacheSize(C4View*, size_t maxBytes);
+
+    /** Deletes the database file and closes/frees the C4View. If other open views share the
+        file, only this view's index is deleted from it. */
     bool c4view_delete(C4View*, C4Error *outError);
 
 
@@ -169,10 +200,19 @@ extern "C" {
                                int viewCount,
                                C4Error *outError);
 
-    /** Creates an enumerator that will return all the documents that need to be (re)indexed. */
+    /** Creates an enumerator that will return all the documents that need to be (re)indexed.
+        If any of the views have document filters, documents that no view accepts are handled
+        by the indexer itself and aren't returned. */
     C4DocEnumerator* c4indexer_enumerateDocuments(C4Indexer *indexer,
                                                   C4Error *outError);
 
+    /** Returns false if a view doesn't need to index a document returned by the enumerator,
+        because its filter rejected the document or it's already indexed it. In that case the
+        map function needn't be run, and c4indexer_emit may be skipped (it would be ignored.) */
+    bool c4indexer_shouldIndex(C4Indexer *indexer,
+                               C4Document *document,
+                               unsigned viewNumber);
+
     /** Adds index rows for the keys/values derived from one document, for one view.
         This function needs to be called *exactly once* for each (document, view) pair during
         indexing. (Even if the view's map function didn't emit anything, the old keys/values need to
@@ -197,6 +237,32 @@ extern "C" {
                         C4Slice emittedValues[],
                         C4Error *outError);
 
+    /** Adds the index rows of many documents at once, for one view. This is equivalent to calling
+        c4indexer_emit for each document, but the keys are passed in a single packed C4Key
+        instead of one C4Key each, and are only copied once on their way into the index.
+        Documents that don't need indexing (see c4indexer_shouldIndex) may be included; their
+        rows are ignored.
+
+        @param indexer  The indexer task.
+        @param viewNumber  The position of the view in the indexer's views[] array.
+        @param docCount  The number of documents.
+        @param documents  Array of the documents being indexed.
+        @param emitCounts  The number of key/value pairs emitted by each document.
+        @param emittedKeys  A single C4Key containing all the emitted keys, in order, one after
+                    another (i.e. built by adding each key's value in turn, not in an array.)
+                    May be NULL if nothing was emitted.
+        @param emittedValues  Array of all the values emitted, in the same order as the keys.
+        @param outError  On failure, error info will be stored here.
+        @return  True on success, false on failure. */
+    bool c4indexer_emitBatch(C4Indexer *indexer,
+                             unsigned viewNumber,
+                             unsigned docCount,
+                             C4Document* documents[],
+                             const unsigned emitCounts[],
+                             const C4Key *emittedKeys,
+                             const C4Slice emittedValues[],
+                             C4Error *outError);
+
     /** Finishes an indexing task and frees the indexer reference.
         @param indexer  The indexer.
         @param commit  True to commit changes to the indexes, false to abort.
@@ -206,6 +272,54 @@ extern "C" {
                        bool commit,
                        C4Error *outError);
 
+
+    //////// BACKGROUND INDEXING:
+
+
+    /** Opaque reference to a background indexing service. */
+    typedef struct c4BackgroundIndexer C4BackgroundIndexer;
+
+    /** A map function run by a background indexer. It's called on the indexer's thread for each
+        changed document, and must call c4indexer_emit exactly once with the given indexer,
+        document and viewNumber, just as during regular indexing. It should return true, or false
+        (after setting outError) to abort the batch. */
+    typedef bool (*C4MapCallback)(void *context,
+                                  C4Indexer *indexer,
+                                  C4Document *document,
+                                  unsigned viewNumber,
+                                  C4Error *outError);
+
+    /** Starts a background indexing service for a database. It keeps the views added to it up to
+        date on its own thread, using its own handles on the database and view files, and is woken
+        up whenever a transaction is committed through the db handle passed in here.
+        Changes are indexed in batches, each in its own transaction, so queries and other writers
+        aren't locked out for long.
+        @param db  The database whose documents are indexed.
+        @param cpuFraction  The fraction of one CPU core the service may use, between 0 and 1.
+                        It sleeps between batches to stay within this budget, except while a
+                        query is waiting for it (kC4UpdateBefore.)
+        @param batchSize  The maximum number of documents indexed in one transaction.
+        @param outError  On failure, error info will be stored here.
+        @return  The new service, or NULL on failure. */
+    C4BackgroundIndexer* c4bgindexer_start(C4Database *db,
+                                           float cpuFraction,
+                                           unsigned batchSize,
+                                           C4Error *outError);
+
+    /** Adds a view to a background indexer. The view must belong to the indexer's database and
+        must stay registered until it's closed (c4view_close removes it automatically.)
+        The map callback is called on the indexer's thread, so it must be thread-safe. */
+    bool c4bgindexer_addView(C4BackgroundIndexer *indexer,
+                             C4View *view,
+                             C4MapCallback map,
+                             void *context,
+                             C4Error *outError);
+
+    /** Stops a background indexer, waiting for any batch in progress to finish, and frees it.
+        This must be called before the database it was started on is closed. */
+    void c4bgindexer_stop(C4BackgroundIndexer *indexer);
+
+
 // A view value that represents a placeholder for the entire document
 #ifdef _MSC_VER
 #define kC4PlaceholderValue ({"*", 1})
@@ -216,6 +330,22 @@ extern "C" {
     //////// QUERYING:
 
 
+    /** Built-in reduce functions that can be applied by a query. */
+    typedef enum {
+        kC4NoReduce = 0,    /**< Return the index rows themselves (default) */
+        kC4ReduceCount,     /**< Number of rows */
+        kC4ReduceSum,       /**< Sum of the rows' values, which must be numbers */
+        kC4ReduceStats      /**< JSON object with "sum", "count", "min", "max" and "sumsqr" */
+    } C4ReduceType;
+
+    /** How a query interacts with a view's background indexer (see c4bgindexer_start.) These
+        have no effect on a view that hasn't been added to a background indexer. */
+    typedef enum {
+        kC4StaleOK = 0,     /**< Query the index as it is (default) */
+        kC4UpdateBefore,    /**< Wait for the background indexer to bring the index up to date */
+        kC4UpdateAfter      /**< Query the index as it is, then wake up the background indexer */
+    } C4StaleMode;
+
     /** Options for view queries. */
     typedef struct {
         uint64_t skip;
@@ -231,6 +361,22 @@ extern "C" {
         
         const C4Key **keys;
         size_t keysCount;
+
+        /** If not kC4NoReduce, rows are aggregated by the given function and the enumerator
+            returns one row per group, with the JSON result as its value and no docID. */
+        C4ReduceType reduce;
+        /** Groups rows by equal keys; without grouping the whole range reduces to one row. */
+        bool group;
+        /** Groups array keys by their first groupLevel items (implies group.) */
+        unsigned groupLevel;
+
+        /** Whether to update the index in the background before or after querying. */
+        C4StaleMode stale;
+
+        /** If true, each row comes with its document's current revision (docRevID, docBody).
+            The documents are fetched a batch of rows at a time, in docID order. Ignored when
+            reducing. */
+        bool includeDocs;
     } C4QueryOptions;
 
     /** Default query options. */
@@ -244,6 +390,8 @@ extern "C" {
         C4Slice value;
         C4Slice docID;
         C4SequenceNumber docSequence;
+        C4Slice docRevID;   /**< With includeDocs: the doc's current revision ID */
+        C4Slice docBody;    /**< With includeDocs: its body (null if deleted or missing) */
     } C4QueryEnumerator;
 
     /** Runs a query and returns an enumerator for the results.
@@ -252,6 +400,13 @@ extern "C" {
                                     const C4QueryOptions *options,
                                     C4Error *outError);
 
+    /** Returns the number of index rows the query would return, without reading their values
+        or docIDs. Rows matching more than one of the `keys` are counted once. The reduce options
+        are ignored. Returns 0 on error, with outError set. */
+    uint64_t c4view_countRows(C4View*,
+                              const C4QueryOptions *options,
+                              C4Error *outError);
+
     /** Advances a query enumerator to the next row, populating its fields.
         Returns true on success, false at the end of enumeration or on error. */
     bool c4queryenum_next(C4QueryEnumerator *e,
@@ -150,6 +150,36 @@ class C4DatabaseTest : public C4Test {
     }
 
 
+    void testLoadAncestorBodies() {
+        const C4Slice kRev3ID = C4STR("3-deadbeef");
+        const C4Slice kBody2 = C4STR("{\"ok\":\"go\"}");
+        const C4Slice kBody3 = C4STR("{\"ok\":\"gone\"}");
+        createRev(kDocID, kRevID, kBody);
+        createRev(kDocID, kRev2ID, kBody2);
+        createRev(kDocID, kRev3ID, kBody3);
+
+        // Walk up the history, loading each ancestor's body from its older doc version:
+        C4Error error;
+        C4Document *doc = c4doc_get(db, kDocID, true, &error);
+        Assert(doc != NULL);
+        AssertEqual(doc->selectedRev.body, kBody3);
+        Assert(c4doc_selectParentRevision(doc));
+        AssertEqual(doc->selectedRev.revID, kRev2ID);
+        Assert(c4doc_hasRevisionBody(doc));
+        Assert(c4doc_loadRevisionBody(doc, &error));
+        AssertEqual(doc->selectedRev.body, kBody2);
+        Assert(c4doc_selectParentRevision(doc));
+        AssertEqual(doc->selectedRev.revID, kRevID);
+        Assert(c4doc_loadRevisionBody(doc, &error));
+        AssertEqual(doc->selectedRev.body, kBody);
+
+        // Going back down re-uses the already-loaded older versions:
+        Assert(c4doc_selectRevision(doc, kRev2ID, true, &error));
+        AssertEqual(doc->selectedRev.body, kBody2);
+        c4doc_free(doc);
+    }
+
+
     void testInsertRevisionWithHistory() {
         const C4Slice kBody2 = C4STR("{\"ok\":\"go\"}");
         createRev(kDocID, kRevID, kBody);
@@ -190,6 +220,104 @@ class C4DatabaseTest : public C4Test {
     }
 
 
+    void testReadRevisionBodyInChunks() {
+        const size_t kSize = 10000;
+        std::string body(kSize, 'x');
+        for (size_t i = 0; i < kSize; i++)
+            body[i] = (char)('a' + i % 26);
+        createRev(kDocID, kRevID, c4str(body.c_str()));
+        createRev(kDocID, kRev2ID, kBody);
+
+        C4Error error;
+        C4Document *doc = c4doc_get(db, kDocID, true, &error);
+        Assert(doc != NULL);
+        Assert(c4doc_selectRevision(doc, kRevID, false, &error));
+        C4BodyReader *reader = c4doc_openRevisionBody(doc, &error);
+        Assert(reader != NULL);
+        AssertEqual(c4bodyreader_getLength(reader), (uint64_t)kSize);
+        std::string result;
+        char buf[999];
+        size_t n;
+        while ((n = c4bodyreader_read(reader, buf, sizeof(buf))) > 0)
+            result.append(buf, n);
+        AssertEqual(result, body);
+        c4bodyreader_free(reader);
+        c4doc_free(doc);
+    }
+
+
+    void testInsertRevisionsBatch() {
+        createRev(c4str("doc-b"), kRevID, kBody);
+
+        C4Slice histA[1] = {kRevID};
+        C4Slice histB[2] = {kRev2ID, kRevID};
+        C4Slice histC[2] = {C4STR("2-aaaa"), C4STR("1-bbbb")};
+        C4Slice histBad[1] = {C4STR("bogus")};
+        C4RevisionInsert revs[5] = {
+            {C4STR("doc-c"), kBody, false, false, histC, 2},
+            {C4STR("doc-b"), kBody, false, false, histB, 2},
+            {C4STR("doc-a"), kBody, false, false, histA, 1},
+            {C4STR("doc-b"), kBody, false, false, histB, 2},    // redundant
+            {C4STR("doc-d"), kBody, false, false, histBad, 1},  // invalid
+        };
+        int results[5];
+        C4Error errors[5];
+        C4Error error;
+        {
+            TransactionHelper t(db);
+            Assert(c4db_insertRevisionsBatch(db, revs, 5, 20, results, errors, &error));
+        }
+        AssertEqual(results[0], 2);
+        AssertEqual(results[1], 1);
+        AssertEqual(results[2], 1);
+        AssertEqual(results[3], 0);
+        AssertEqual(results[4], -1);
+
+        C4Document *doc = c4doc_get(db, c4str("doc-b"), true, &error);
+        Assert(doc != NULL);
+        AssertEqual(doc->revID, kRev2ID);
+        AssertEqual(doc->selectedRev.body, kBody);
+        c4doc_free(doc);
+        doc = c4doc_get(db, c4str("doc-c"), true, &error);
+        Assert(doc != NULL);
+        AssertEqual(doc->revID, C4STR("2-aaaa"));
+        c4doc_free(doc);
+        doc = c4doc_get(db, c4str("doc-d"), true, &error);
+        Assert(doc == NULL);
+        AssertEqual(c4db_getDocumentCount(db), 3ull);
+    }
+
+
+    void testFindMissingRevisions() {
+        createRev(c4str("doc-a"), kRevID, kBody);
+        createRev(c4str("doc-a"), kRev2ID, kBody);
+        createRev(c4str("doc-b"), kRevID, kBody);
+
+        C4Slice revsA[3] = {kRev2ID, kRevID, C4STR("3-ffff")};
+        C4Slice revsB[1] = {kRevID};
+        C4Slice revsC[1] = {kRevID};
+        bool missingA[3], missingB[1], missingC[1];
+        C4RevsDiff diffs[3] = {
+            {C4STR("doc-c"), revsC, 1, missingC},
+            {C4STR("doc-a"), revsA, 3, missingA},
+            {C4STR("doc-b"), revsB, 1, missingB},
+        };
+        C4Error error;
+        Assert(c4db_findMissingRevisions(db, diffs, 3, &error));
+
+        Assert(missingC[0]);
+        AssertEqual(diffs[0].possibleAncestors.buf, (const void*)NULL);
+        Assert(!missingA[0]);
+        Assert(!missingA[1]);
+        Assert(missingA[2]);
+        AssertEqual(toString(diffs[1].possibleAncestors), std::string("[\"") + toString(kRev2ID) + "\"]");
+        Assert(!missingB[0]);
+        AssertEqual(diffs[2].possibleAncestors.buf, (const void*)NULL);
+        for (int i = 0; i < 3; i++)
+            c4slice_free(diffs[i].possibleAncestors);
+    }
+
+
     void setupAllDocs() {
         char docID[20];
         for (int i = 1; i < 100; i++) {
@@ -329,7 +457,11 @@ class C4DatabaseTest : public C4Test {
     CPPUNIT_TEST( testCreateRawDoc );
     CPPUNIT_TEST( testCreateVersionedDoc );
     CPPUNIT_TEST( testCreateMultipleRevisions );
+    CPPUNIT_TEST( testLoadAncestorBodies );
     CPPUNIT_TEST( testInsertRevisionWithHistory );
+    CPPUNIT_TEST( testReadRevisionBodyInChunks );
+    CPPUNIT_TEST( testInsertRevisionsBatch );
+    CPPUNIT_TEST( testFindMissingRevisions );
     CPPUNIT_TEST( testAllDocs );
     CPPUNIT_TEST( testChanges );
     CPPUNIT_TEST_SUITE_END();
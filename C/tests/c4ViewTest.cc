@@ -8,9 +8,15 @@
 
 #include "c4Test.hh"
 #include "C4View.h"
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <limits.h>
+#include <thread>
+#include <vector>
 
 static const char *kViewIndexPath = "/tmp/forest_temp.view.index";
+static const char *kPlainViewIndexPath = "/tmp/forest_temp.plainview.index";
 
 
 class C4ViewTest : public C4Test {
@@ -108,6 +114,635 @@ public:
         AssertEqual(i, 200);
     }
 
+    void testIncludeDocs() {
+        createIndex();
+
+        C4Error error;
+        C4QueryOptions options = kC4DefaultQueryOptions;
+        options.includeDocs = true;
+        auto e = c4view_query(view, &options, &error);
+        Assert(e);
+
+        int i = 0;
+        while (c4queryenum_next(e, &error)) {
+            ++i;
+            char buf[20];
+            if (i <= 100)
+                sprintf(buf, "%d", i);
+            else
+                sprintf(buf, "\"doc-%03d\"", i - 100);
+            AssertEqual(toJSON(e->key), std::string(buf));
+            AssertEqual(e->value, c4str("1234"));
+            AssertEqual(e->docRevID, kRevID);
+            AssertEqual(e->docBody, kBody);
+        }
+        AssertEqual(error.code, 0);
+        AssertEqual(i, 200);
+        c4queryenum_free(e);
+    }
+
+    void testEmitBatch() {
+        createIndex();
+        C4QueryOptions options = kC4DefaultQueryOptions;
+        std::string expectedRows = queryRows(view, options);
+
+        // Index the same rows again, several documents per call, with all their keys packed
+        // into one C4Key:
+        C4Error error;
+        Assert(c4view_eraseIndex(view, &error));
+        C4Indexer* ind = c4indexer_begin(db, &view, 1, &error);
+        Assert(ind);
+        C4DocEnumerator* e = c4indexer_enumerateDocuments(ind, &error);
+        Assert(e);
+        static const unsigned kBatchSize = 7;
+        std::vector<C4Document*> docs;
+        std::vector<unsigned> emitCounts;
+        std::vector<C4Slice> values;
+        C4Key *keys = c4key_new();
+        bool more = true;
+        while (more) {
+            C4Document *doc = c4enum_nextDocument(e, &error);
+            more = (doc != NULL);
+            if (doc) {
+                c4key_addString(keys, doc->docID);
+                c4key_addNumber(keys, doc->sequence);
+                values.push_back(c4str("1234"));
+                values.push_back(c4str("1234"));
+                docs.push_back(doc);
+                emitCounts.push_back(2);
+            }
+            if (docs.size() == kBatchSize || (!more && !docs.empty())) {
+                Assert(c4indexer_emitBatch(ind, 0, (unsigned)docs.size(), docs.data(),
+                                           emitCounts.data(), keys, values.data(), &error));
+                for (auto d = docs.begin(); d != docs.end(); ++d)
+                    c4doc_free(*d);
+                docs.clear();
+                emitCounts.clear();
+                values.clear();
+                c4key_free(keys);
+                keys = c4key_new();
+            }
+        }
+        c4key_free(keys);
+        AssertEqual(error.code, 0);
+        c4enum_free(e);
+        Assert(c4indexer_end(ind, true, &error));
+
+        AssertEqual(c4view_getTotalRows(view), 200ull);
+        AssertEqual(c4view_getLastSequenceIndexed(view), 100ull);
+        AssertEqual(queryRows(view, options), expectedRows);
+    }
+
+    // Emits a row with key [seq % 3, seq] and value seq for each document, into each view.
+    // Emits [seq%3, seq] for each doc. With mixedKeys, every fourth doc emits a string instead,
+    // and the others [seq%3, {"n": seq}].
+    void indexModulo(C4View **views, unsigned viewCount, bool mixedKeys =false) {
+        C4Error error;
+        C4Indexer* ind = c4indexer_begin(db, views, viewCount, &error);
+        Assert(ind);
+        C4DocEnumerator* e = c4indexer_enumerateDocuments(ind, &error);
+        Assert(e);
+        C4Document *doc;
+        while (NULL != (doc = c4enum_nextDocument(e, &error))) {
+            C4Key *key = c4key_new();
+            char value[20];
+            if (mixedKeys && doc->sequence % 4 == 0) {
+                sprintf(value, "str-%03llu", (unsigned long long)doc->sequence);
+                c4key_addString(key, c4str(value));
+            } else {
+                c4key_beginArray(key);
+                c4key_addNumber(key, (double)(doc->sequence % 3));
+                if (mixedKeys) {
+                    c4key_beginMap(key);
+                    c4key_addMapKey(key, c4str("n"));
+                    c4key_addNumber(key, (double)doc->sequence);
+                    c4key_endMap(key);
+                } else {
+                    c4key_addNumber(key, (double)doc->sequence);
+                }
+                c4key_endArray(key);
+            }
+            sprintf(value, "%llu", (unsigned long long)doc->sequence);
+            C4Slice valueSlice = c4str(value);
+            for (unsigned v = 0; v < viewCount; ++v)
+                Assert(c4indexer_emit(ind, doc, v, 1, &key, &valueSlice, &error));
+            c4key_free(key);
+            c4doc_free(doc);
+        }
+        AssertEqual(error.code, 0);
+        c4enum_free(e);
+        Assert(c4indexer_end(ind, true, &error));
+    }
+
+    // Runs a query and returns its rows as "key=value docID seq" lines.
+    std::string queryRows(C4View *v, const C4QueryOptions &options) {
+        C4Error error;
+        auto q = c4view_query(v, &options, &error);
+        Assert(q);
+        std::string rows;
+        while (c4queryenum_next(q, &error)) {
+            char seq[30];
+            sprintf(seq, " %llu\n", (unsigned long long)q->docSequence);
+            rows += toJSON(q->key) + "=";
+            rows.append((const char*)q->value.buf, q->value.size);
+            rows += " ";
+            rows.append((const char*)q->docID.buf, q->docID.size);
+            rows += seq;
+        }
+        AssertEqual(error.code, 0);
+        c4queryenum_free(q);
+        return rows;
+    }
+
+    void testReduce() {
+        char docID[20];
+        for (int i = 1; i <= 100; i++) {
+            sprintf(docID, "doc-%03d", i);
+            createRev(c4str(docID), kRevID, kBody);
+        }
+        indexModulo(&view, 1);
+        C4Error error;
+
+        // Count without grouping:
+        C4QueryOptions options = kC4DefaultQueryOptions;
+        options.reduce = kC4ReduceCount;
+        auto q = c4view_query(view, &options, &error);
+        Assert(q);
+        Assert(c4queryenum_next(q, &error));
+        AssertEqual(toJSON(q->key), std::string("null"));
+        AssertEqual(q->value, c4str("100"));
+        Assert(!c4queryenum_next(q, &error));
+        AssertEqual(error.code, 0);
+        c4queryenum_free(q);
+
+        // Stats without grouping:
+        options.reduce = kC4ReduceStats;
+        q = c4view_query(view, &options, &error);
+        Assert(q);
+        Assert(c4queryenum_next(q, &error));
+        AssertEqual(q->value,
+                    c4str("{\"sum\":5050,\"count\":100,\"min\":1,\"max\":100,\"sumsqr\":338350}"));
+        Assert(!c4queryenum_next(q, &error));
+        c4queryenum_free(q);
+
+        // Sum grouped by the first array item:
+        options.reduce = kC4ReduceSum;
+        options.groupLevel = 1;
+        q = c4view_query(view, &options, &error);
+        Assert(q);
+        const char* expectedKeys[3] = {"[0]", "[1]", "[2]"};
+        const char* expectedSums[3] = {"1683", "1717", "1650"};
+        int i = 0;
+        while (c4queryenum_next(q, &error)) {
+            AssertEqual(toJSON(q->key), std::string(expectedKeys[i]));
+            AssertEqual(q->value, c4str(expectedSums[i]));
+            Assert(q->docID.buf == NULL);
+            ++i;
+        }
+        AssertEqual(error.code, 0);
+        AssertEqual(i, 3);
+        c4queryenum_free(q);
+
+        // Skip and limit apply to the groups:
+        options.reduce = kC4ReduceCount;
+        options.skip = 1;
+        options.limit = 1;
+        q = c4view_query(view, &options, &error);
+        Assert(q);
+        Assert(c4queryenum_next(q, &error));
+        AssertEqual(toJSON(q->key), std::string("[1]"));
+        AssertEqual(q->value, c4str("34"));
+        Assert(!c4queryenum_next(q, &error));
+        c4queryenum_free(q);
+
+        // Exact grouping gives one row per key:
+        options.skip = 0;
+        options.limit = UINT_MAX;
+        options.groupLevel = 0;
+        options.group = true;
+        q = c4view_query(view, &options, &error);
+        Assert(q);
+        i = 0;
+        while (c4queryenum_next(q, &error)) {
+            AssertEqual(q->value, c4str("1"));
+            ++i;
+        }
+        AssertEqual(i, 100);
+        c4queryenum_free(q);
+    }
+
+    void testAggregateReduce() {
+        // Index the same rows into this view, with aggregates, and into a plain one:
+        C4Error error;
+        Assert(c4view_setAggregateLevels(view, 1, &error));
+        ::unlink(kPlainViewIndexPath);
+        C4View *plain = c4view_open(db, c4str(kPlainViewIndexPath), c4str("plain"), c4str("1"),
+                                    kC4DB_Create, encryptionKey(), &error);
+        Assert(plain);
+
+        char docID[20];
+        for (int i = 1; i <= 100; i++) {
+            sprintf(docID, "doc-%03d", i);
+            createRev(c4str(docID), kRevID, kBody);
+        }
+        C4View* views[2] = {view, plain};
+        indexModulo(views, 2);
+
+        for (int pass = 0; pass < 2; ++pass) {
+            C4Key *startKey = c4key_new(), *endKey = c4key_new();
+            c4key_beginArray(startKey);
+            c4key_addNumber(startKey, 0);
+            c4key_addNumber(startKey, 10);
+            c4key_endArray(startKey);
+            c4key_beginArray(endKey);
+            c4key_addNumber(endKey, 2);
+            c4key_addNumber(endKey, 50);
+            c4key_endArray(endKey);
+            checkAggregateReduces(plain, startKey, endKey);
+            c4key_free(startKey);
+            c4key_free(endKey);
+
+            // Now update some docs, which changes their keys, and delete some others:
+            if (pass == 0) {
+                for (int i = 1; i <= 50; i++) {
+                    sprintf(docID, "doc-%03d", i);
+                    createRev(c4str(docID), kRev2ID, (i <= 30 ? kBody : kC4SliceNull));
+                }
+                indexModulo(views, 2);
+                AssertEqual(c4view_getTotalRows(view), 80ull);
+            }
+        }
+        Assert(c4view_delete(plain, &error));
+    }
+
+    // Every reduce of the view must come out the same as the plain view's, which reads all the
+    // rows, with or without grouping and a key range, in either direction.
+    void checkAggregateReduces(C4View *plain, C4Key *startKey, C4Key *endKey) {
+        for (int variant = 0; variant < 16; ++variant) {
+            C4QueryOptions options = kC4DefaultQueryOptions;
+            options.reduce = (variant & 1) ? kC4ReduceSum : kC4ReduceCount;
+            options.groupLevel = (variant & 2) ? 1 : 0;
+            if (variant & 4) {
+                options.startKey = startKey;
+                options.endKey = endKey;
+                options.inclusiveEnd = false;
+            }
+            if (variant & 8) {
+                options.descending = true;
+                std::swap(options.startKey, options.endKey);
+                std::swap(options.inclusiveStart, options.inclusiveEnd);
+            }
+            std::string expected = queryRows(plain, options);
+            Assert(!expected.empty());
+            AssertEqual(queryRows(view, options), expected);
+        }
+    }
+
+    void testAggregateReduceMixedKeys() {
+        // Array keys whose second item is a map, next to string keys, exercise the ends of the
+        // groups and the byte-prefix totals:
+        C4Error error;
+        Assert(c4view_setAggregateLevels(view, 1, &error));
+        ::unlink(kPlainViewIndexPath);
+        C4View *plain = c4view_open(db, c4str(kPlainViewIndexPath), c4str("plain"), c4str("1"),
+                                    kC4DB_Create, encryptionKey(), &error);
+        Assert(plain);
+
+        char docID[20];
+        for (int i = 1; i <= 100; i++) {
+            sprintf(docID, "doc-%03d", i);
+            createRev(c4str(docID), kRevID, kBody);
+        }
+        C4View* views[2] = {view, plain};
+        indexModulo(views, 2, true);
+
+        C4Key *startKey = c4key_new(), *endKey = c4key_new();
+        c4key_beginArray(startKey);
+        c4key_addNumber(startKey, 1);
+        c4key_endArray(startKey);
+        c4key_addString(endKey, c4str("str-050"));
+        checkAggregateReduces(plain, startKey, endKey);
+        c4key_free(startKey);
+        c4key_free(endKey);
+
+        // Within a single group:
+        startKey = c4key_new();
+        endKey = c4key_new();
+        c4key_beginArray(startKey);
+        c4key_addNumber(startKey, 2);
+        c4key_endArray(startKey);
+        c4key_beginArray(endKey);
+        c4key_addNumber(endKey, 2);
+        c4key_beginMap(endKey);
+        c4key_addMapKey(endKey, c4str("n"));
+        c4key_addNumber(endKey, 50);
+        c4key_endMap(endKey);
+        c4key_endArray(endKey);
+        checkAggregateReduces(plain, startKey, endKey);
+        c4key_free(startKey);
+        c4key_free(endKey);
+        Assert(c4view_delete(plain, &error));
+    }
+
+    void testAggregateReduceLongKeys() {
+        // String keys sharing their first 7 characters fill the deepest byte-prefix totals, and
+        // the range's two ends fall in buckets that differ only in their last (8th) byte:
+        C4Error error;
+        Assert(c4view_setAggregateLevels(view, 1, &error));
+        ::unlink(kPlainViewIndexPath);
+        C4View *plain = c4view_open(db, c4str(kPlainViewIndexPath), c4str("plain"), c4str("1"),
+                                    kC4DB_Create, encryptionKey(), &error);
+        Assert(plain);
+
+        char docID[20];
+        for (int i = 1; i <= 100; i++) {
+            sprintf(docID, "doc-%03d", i);
+            createRev(c4str(docID), kRevID, kBody);
+        }
+        C4View* views[2] = {view, plain};
+        C4Indexer* ind = c4indexer_begin(db, views, 2, &error);
+        Assert(ind);
+        C4DocEnumerator* e = c4indexer_enumerateDocuments(ind, &error);
+        Assert(e);
+        C4Document *doc;
+        while (NULL != (doc = c4enum_nextDocument(e, &error))) {
+            char keyStr[20], value[20];
+            sprintf(keyStr, "custom%c-%03llu", (char)('a' + doc->sequence % 3),
+                    (unsigned long long)doc->sequence);
+            C4Key *key = c4key_new();
+            c4key_addString(key, c4str(keyStr));
+            sprintf(value, "%llu", (unsigned long long)doc->sequence);
+            C4Slice valueSlice = c4str(value);
+            for (unsigned v = 0; v < 2; ++v)
+                Assert(c4indexer_emit(ind, doc, v, 1, &key, &valueSlice, &error));
+            c4key_free(key);
+            c4doc_free(doc);
+        }
+        AssertEqual(error.code, 0);
+        c4enum_free(e);
+        Assert(c4indexer_end(ind, true, &error));
+
+        C4Key *startKey = c4key_new(), *endKey = c4key_new();
+        c4key_addString(startKey, c4str("customa-050"));
+        c4key_addString(endKey, c4str("customc-020"));
+        checkAggregateReduces(plain, startKey, endKey);
+        c4key_free(startKey);
+        c4key_free(endKey);
+        Assert(c4view_delete(plain, &error));
+    }
+
+    void testQueryCache() {
+        createIndex();
+        c4view_setQueryCacheSize(view, 1024*1024);
+
+        C4QueryOptions options = kC4DefaultQueryOptions;
+        options.skip = 10;
+        options.limit = 50;
+        std::string rows = queryRows(view, options);
+        AssertEqual((long)std::count(rows.begin(), rows.end(), '\n'), 50L);
+        // The second time the results come from the cache:
+        AssertEqual(queryRows(view, options), rows);
+
+        // Different options aren't a match:
+        options.descending = true;
+        std::string descRows = queryRows(view, options);
+        Assert(descRows != rows);
+        AssertEqual(queryRows(view, options), descRows);
+
+        // Changing the index invalidates the cache:
+        createRev(c4str("doc-000"), kRevID, kBody);
+        C4Error error;
+        C4Indexer* ind = c4indexer_begin(db, &view, 1, &error);
+        Assert(ind);
+        C4DocEnumerator* e = c4indexer_enumerateDocuments(ind, &error);
+        Assert(e);
+        C4Document *doc;
+        while (NULL != (doc = c4enum_nextDocument(e, &error))) {
+            C4Key *key = c4key_new();
+            c4key_addNumber(key, 0);    // sorts before all the other rows
+            C4Slice value = c4str("1234");
+            Assert(c4indexer_emit(ind, doc, 0, 1, &key, &value, &error));
+            c4key_free(key);
+            c4doc_free(doc);
+        }
+        c4enum_free(e);
+        Assert(c4indexer_end(ind, true, &error));
+
+        options.descending = false;
+        std::string newRows = queryRows(view, options);
+        Assert(newRows != rows);
+        AssertEqual(queryRows(view, options), newRows);
+
+        // Turning the cache off still gives the same results:
+        c4view_setQueryCacheSize(view, 0);
+        AssertEqual(queryRows(view, options), newRows);
+
+        // Changing the aggregate levels erases the index, and with it the cached results:
+        c4view_setQueryCacheSize(view, 1024*1024);
+        AssertEqual(queryRows(view, options), newRows);
+        Assert(c4view_setAggregateLevels(view, 1, &error));
+        AssertEqual(queryRows(view, options), std::string());
+    }
+
+    void testCountRows() {
+        createIndex();
+        C4Error error;
+        C4QueryOptions options = kC4DefaultQueryOptions;
+        AssertEqual(c4view_countRows(view, &options, &error), 200ull);
+        options.skip = 5;
+        options.limit = 3;
+        AssertEqual(c4view_countRows(view, &options, &error), 3ull);
+
+        options = kC4DefaultQueryOptions;
+        options.startKey = c4key_new();
+        c4key_addNumber(options.startKey, 10);
+        options.endKey = c4key_new();
+        c4key_addNumber(options.endKey, 20);
+        AssertEqual(c4view_countRows(view, &options, &error), 11ull);
+        options.inclusiveStart = options.inclusiveEnd = false;
+        AssertEqual(c4view_countRows(view, &options, &error), 9ull);
+        options.descending = true;
+        std::swap(options.startKey, options.endKey);
+        AssertEqual(c4view_countRows(view, &options, &error), 9ull);
+        c4key_free(options.startKey);
+        c4key_free(options.endKey);
+
+        // Repeated keys are only counted once:
+        options = kC4DefaultQueryOptions;
+        C4Key *keys[4] = {c4key_new(), c4key_new(), c4key_new(), c4key_new()};
+        c4key_addNumber(keys[0], 50);
+        c4key_addString(keys[1], c4str("doc-050"));
+        c4key_addNumber(keys[2], 50);
+        c4key_addNumber(keys[3], 1000);
+        options.keys = (const C4Key**)keys;
+        options.keysCount = 4;
+        AssertEqual(c4view_countRows(view, &options, &error), 2ull);
+        AssertEqual(error.code, 0);
+        for (int i = 0; i < 4; ++i)
+            c4key_free(keys[i]);
+    }
+
+    // Map function for the background indexer; emits each doc's ID as a key.
+    static bool mapDocID(void *context, C4Indexer *indexer, C4Document *doc,
+                         unsigned viewNumber, C4Error *outError)
+    {
+        C4Key *key = c4key_new();
+        c4key_addString(key, doc->docID);
+        C4Slice value = c4str("1");
+        bool ok = c4indexer_emit(indexer, doc, viewNumber, 1, &key, &value, outError);
+        c4key_free(key);
+        return ok;
+    }
+
+    void testBackgroundIndexer() {
+        char docID[20];
+        for (int i = 1; i <= 50; i++) {
+            sprintf(docID, "doc-%03d", i);
+            createRev(c4str(docID), kRevID, kBody);
+        }
+
+        C4Error error;
+        C4BackgroundIndexer *bg = c4bgindexer_start(db, 0.5f, 10, &error);
+        Assert(bg);
+        Assert(c4bgindexer_addView(bg, view, mapDocID, NULL, &error));
+
+        C4QueryOptions options = kC4DefaultQueryOptions;
+        options.stale = kC4UpdateBefore;
+        AssertEqual(c4view_countRows(view, &options, &error), 50ull);
+        AssertEqual(c4view_getLastSequenceIndexed(view), 50ull);
+
+        // Commits wake up the indexer:
+        for (int i = 51; i <= 60; i++) {
+            sprintf(docID, "doc-%03d", i);
+            createRev(c4str(docID), kRevID, kBody);
+        }
+        AssertEqual(queryRows(view, options).substr(0, 15), std::string("\"doc-001\"=1 doc"));
+        AssertEqual(c4view_getTotalRows(view), 60ull);
+
+        c4bgindexer_stop(bg);
+
+        // Without a background indexer the view isn't updated:
+        createRev(c4str("doc-061"), kRevID, kBody);
+        AssertEqual(c4view_countRows(view, &options, &error), 60ull);
+    }
+
+    void testTwoBackgroundIndexers() {
+        // Each indexer observes the database's commits; stopping one mustn't affect the other:
+        C4Error error;
+        ::unlink(kPlainViewIndexPath);
+        C4View *other = c4view_open(db, c4str(kPlainViewIndexPath), c4str("plain"), c4str("1"),
+                                    kC4DB_Create, encryptionKey(), &error);
+        Assert(other);
+        C4BackgroundIndexer *bg1 = c4bgindexer_start(db, 1.0f, 10, &error);
+        Assert(bg1);
+        C4BackgroundIndexer *bg2 = c4bgindexer_start(db, 1.0f, 10, &error);
+        Assert(bg2);
+        Assert(c4bgindexer_addView(bg1, view, mapDocID, NULL, &error));
+        Assert(c4bgindexer_addView(bg2, other, mapDocID, NULL, &error));
+        c4bgindexer_stop(bg2);
+
+        char docID[20];
+        for (int i = 1; i <= 20; i++) {
+            sprintf(docID, "doc-%03d", i);
+            createRev(c4str(docID), kRevID, kBody);
+        }
+        // The commits alone must wake up the remaining indexer:
+        for (int i = 0; i < 500 && c4view_getLastSequenceIndexed(view) < 20; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        AssertEqual(c4view_getLastSequenceIndexed(view), 20ull);
+        AssertEqual(c4view_getLastSequenceIndexed(other), 0ull);
+
+        c4bgindexer_stop(bg1);
+        Assert(c4view_delete(other, &error));
+    }
+
+    void createTypedRev(const char *docID, C4Slice revID, const char *docType) {
+        TransactionHelper t(db);
+        C4Error error;
+        C4Document *doc = c4doc_get(db, c4str(docID), false, &error);
+        Assert(doc != NULL);
+        AssertEqual(c4doc_insertRevision(doc, revID, kBody, false, false, false, &error), 1);
+        Assert(c4doc_setType(doc, c4str(docType), &error));
+        Assert(c4doc_save(doc, 20, &error));
+        c4doc_free(doc);
+    }
+
+    // Indexes the view, emitting each doc's ID; returns the number of docs the indexer returned.
+    int indexDocIDs() {
+        C4Error error;
+        C4Indexer *ind = c4indexer_begin(db, &view, 1, &error);
+        Assert(ind);
+        C4DocEnumerator *e = c4indexer_enumerateDocuments(ind, &error);
+        int nDocs = 0;
+        if (e) {
+            C4Document *doc;
+            while (NULL != (doc = c4enum_nextDocument(e, &error))) {
+                ++nDocs;
+                Assert(c4indexer_shouldIndex(ind, doc, 0));
+                C4Key *key = c4key_new();
+                c4key_addString(key, doc->docID);
+                C4Slice value = c4str("1");
+                Assert(c4indexer_emit(ind, doc, 0, 1, &key, &value, &error));
+                c4key_free(key);
+                c4doc_free(doc);
+            }
+            c4enum_free(e);
+        }
+        AssertEqual(error.code, 0);
+        Assert(c4indexer_end(ind, true, &error));
+        return nDocs;
+    }
+
+    void testDocumentFilter() {
+        char docID[20];
+        for (int i = 1; i <= 20; i++) {
+            sprintf(docID, "doc-%03d", i);
+            createTypedRev(docID, kRevID, (i % 4 == 0) ? "widget" : "gadget");
+        }
+        c4view_setDocumentFilter(view, c4str("widget"), false);
+
+        // Only the widgets are read, but the view is up to date with all the docs:
+        AssertEqual(indexDocIDs(), 5);
+        AssertEqual(c4view_getTotalRows(view), 5ull);
+        AssertEqual(c4view_getLastSequenceIndexed(view), 20ull);
+
+        // A widget that becomes a gadget loses its row without being read:
+        createTypedRev("doc-004", kRev2ID, "gadget");
+        AssertEqual(indexDocIDs(), 0);
+        AssertEqual(c4view_getTotalRows(view), 4ull);
+        AssertEqual(c4view_getLastSequenceIndexed(view), 21ull);
+
+        // And a deleted widget is dropped too:
+        createRev(c4str("doc-008"), kRev2ID, kC4SliceNull);
+        AssertEqual(indexDocIDs(), 0);
+        AssertEqual(c4view_getTotalRows(view), 3ull);
+    }
+
+    void testSharedViewFile() {
+        C4Error error;
+        C4View *other = c4view_open(db, c4str(kViewIndexPath), c4str("otherview"), c4str("1"),
+                                    kC4DB_Create, encryptionKey(), &error);
+        Assert(other);
+        char docID[20];
+        for (int i = 1; i <= 20; i++) {
+            sprintf(docID, "doc-%03d", i);
+            createRev(c4str(docID), kRevID, kBody);
+        }
+
+        // Both views are in one file, so they're indexed in one transaction:
+        C4View *views[2] = {view, other};
+        indexModulo(views, 2);
+        AssertEqual(c4view_getTotalRows(view), 20ull);
+        AssertEqual(c4view_getTotalRows(other), 20ull);
+        AssertEqual(c4view_getLastSequenceIndexed(other), 20ull);
+
+        // Deleting one view leaves the other one intact:
+        Assert(c4view_delete(other, &error));
+        AssertEqual(c4view_getTotalRows(view), 20ull);
+        AssertEqual(c4view_getLastSequenceIndexed(view), 20ull);
+        Assert(!queryRows(view, kC4DefaultQueryOptions).empty());
+    }
+
     void testIndexVersion() {
         createIndex();
 
@@ -139,6 +774,18 @@ public:
     CPPUNIT_TEST( testEmptyState );
     CPPUNIT_TEST( testCreateIndex );
     CPPUNIT_TEST( testQueryIndex );
+    CPPUNIT_TEST( testIncludeDocs );
+    CPPUNIT_TEST( testEmitBatch );
+    CPPUNIT_TEST( testReduce );
+    CPPUNIT_TEST( testAggregateReduce );
+    CPPUNIT_TEST( testAggregateReduceMixedKeys );
+    CPPUNIT_TEST( testAggregateReduceLongKeys );
+    CPPUNIT_TEST( testQueryCache );
+    CPPUNIT_TEST( testCountRows );
+    CPPUNIT_TEST( testBackgroundIndexer );
+    CPPUNIT_TEST( testTwoBackgroundIndexers );
+    CPPUNIT_TEST( testDocumentFilter );
+    CPPUNIT_TEST( testSharedViewFile );
     CPPUNIT_TEST( testIndexVersion );
     CPPUNIT_TEST_SUITE_END();
 };
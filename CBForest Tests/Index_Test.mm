@@ -237,6 +237,183 @@ static boolBlock scopedEnumerate() {
     XCTAssertEqual([self doQuery], 3);
 }
 
+- (void) testUnchangedRows {
+    std::vector<Collatable> keys;
+    std::vector<alloc_slice> values;
+    keys.push_back(Collatable("Schlage"));
+    values.push_back(alloc_slice("purple"));
+    keys.push_back(Collatable("Master"));
+    values.push_back(alloc_slice("gray"));
+    {
+        Transaction trans(database);
+        IndexWriter writer(index, trans);
+        Assert(writer.update(slice("doc1"), 1, keys, values, _rowCount));
+        // Same keys & values, so nothing changes:
+        Assert(!writer.update(slice("doc1"), 2, keys, values, _rowCount));
+        // A changed value is detected from its hash:
+        values[1] = alloc_slice("grey");
+        Assert(writer.update(slice("doc1"), 3, keys, values, _rowCount));
+        Assert(!writer.update(slice("doc1"), 4, keys, values, _rowCount));
+        AssertEq(_rowCount, 2u);
+    }
+    XCTAssertEqual([self doQuery], 2);
+    alloc_slice value = index->getEntry(slice("doc1"), 3, Collatable("Master"), 1);
+    AssertEqual((NSString*)value, @"grey");
+}
+
+static NSArray* keysOf(IndexEnumerator &e) {
+    NSMutableArray* keys = [NSMutableArray array];
+    while (e.next()) {
+        alloc_slice keyStr = e.key().readString();
+        [keys addObject: [[NSString alloc] initWithBytes: keyStr.buf length: keyStr.size
+                                                encoding: NSUTF8StringEncoding]];
+    }
+    return keys;
+}
+
+- (void) testEqualKeysOrderedByDocID {
+    // Rows with equal keys come out in docID order, whatever order they were indexed in:
+    std::vector<Collatable> keys;
+    std::vector<alloc_slice> values;
+    keys.push_back(Collatable("Schlage"));
+    values.push_back(alloc_forestdb::slice("purple"));
+    {
+        Transaction trans(database);
+        IndexWriter writer(index, trans);
+        Assert(writer.update(forestdb::slice("doc3"), 1, keys, values, _rowCount));
+        Assert(writer.update(forestdb::slice("doc1"), 2, keys, values, _rowCount));
+        Assert(writer.update(forestdb::slice("doc2"), 3, keys, values, _rowCount));
+    }
+    auto docIDsFrom = [&](forestdb::slice startDocID, forestdb::slice endDocID) {
+        NSMutableArray* docIDs = [NSMutableArray array];
+        for (IndexEnumerator e(index, Collatable("Schlage"), startDocID,
+                               Collatable("Schlage"), endDocID,
+                               DocEnumerator::Options::kDefault); e.next(); )
+            [docIDs addObject: (NSString*)e.docID()];
+        return docIDs;
+    };
+    AssertEqual(docIDsFrom(forestdb::slice::null, forestdb::slice::null), (@[@"doc1", @"doc2", @"doc3"]));
+
+    // startKeyDocID and endKeyDocID bound that order, even if they aren't in the index:
+    AssertEqual(docIDsFrom(forestdb::slice("doc2"), forestdb::slice::null), (@[@"doc2", @"doc3"]));
+    AssertEqual(docIDsFrom(forestdb::slice("doc15"), forestdb::slice("doc25")), (@[@"doc2"]));
+    AssertEqual(docIDsFrom(forestdb::slice("doc4"), forestdb::slice::null), (@[]));
+
+    // A doc that no longer emits anything loses its rows:
+    {
+        Transaction trans(database);
+        IndexWriter writer(index, trans);
+        Assert(writer.update(forestdb::slice("doc1"), 4, std::vector<Collatable>(),
+                             std::vector<alloc_slice>(), _rowCount));
+    }
+    AssertEqual(docIDsFrom(forestdb::slice::null, forestdb::slice::null), (@[@"doc2", @"doc3"]));
+}
+
+- (void) testKeyRangeOrder {
+    {
+        Transaction trans(database);
+        IndexWriter writer(index, trans);
+        [self updateDoc: @"A" body: @[@"fruit", @"Apple", @"Banana", @"Cherry"] writer: writer];
+        [self updateDoc: @"B" body: @[@"fruit", @"Date", @"Elderberry", @"Fig"] writer: writer];
+    }
+    // Unsorted, repeated and overlapping keys:
+    std::vector<KeyRange> keys;
+    keys.push_back(Collatable("Fig"));
+    keys.push_back(Collatable("Banana"));
+    keys.push_back(Collatable("Grape"));
+    keys.push_back(Collatable("Fig"));
+    keys.push_back(KeyRange(Collatable("Cherry"), Collatable("Date")));
+    keys.push_back(Collatable("Date"));
+
+    NSLog(@"--- Sorted");
+    IndexEnumerator e1(index, keys, DocEnumerator::Options::kDefault);
+    AssertEqual(keysOf(e1), (@[@"Banana", @"Cherry", @"Date", @"Fig"]));
+
+    NSLog(@"--- Sorted, descending");
+    auto options = DocEnumerator::Options::kDefault;
+    options.descending = true;
+    IndexEnumerator e2(index, keys, options);
+    AssertEqual(keysOf(e2), (@[@"Fig", @"Date", @"Cherry", @"Banana"]));
+
+    NSLog(@"--- Caller's order");
+    IndexEnumerator e3(index, keys, DocEnumerator::Options::kDefault, true);
+    AssertEqual(keysOf(e3), (@[@"Fig", @"Banana", @"Fig", @"Cherry", @"Date", @"Date"]));
+
+    NSLog(@"--- Caller's order, with skip and limit");
+    options = DocEnumerator::Options::kDefault;
+    options.skip = 1;
+    options.limit = 3;
+    IndexEnumerator e4(index, keys, options, true);
+    AssertEqual(keysOf(e4), (@[@"Banana", @"Fig", @"Cherry"]));
+
+    NSLog(@"--- Caller's order, descending, with limit");
+    options = DocEnumerator::Options::kDefault;
+    options.descending = true;
+    options.limit = 4;
+    IndexEnumerator e5(index, keys, options, true);
+    AssertEqual(keysOf(e5), (@[@"Fig", @"Banana", @"Fig", @"Date"]));
+}
+
+- (void) testPreloadedUpdates {
+    NSDictionary* docs = @{
+        @"CA": @[@"California", @"San Jose", @"San Francisco", @"Cambria"],
+        @"WA": @[@"Washington", @"Seattle", @"Port Townsend", @"Skookumchuk"],
+        @"OR": @[@"Oregon", @"Portland", @"Eugene"]};
+    {
+        Transaction trans(database);
+        IndexWriter writer(index, trans);
+        for (NSString* docID in docs)
+            [self updateDoc: docID body: docs[docID] writer: writer];
+    }
+    XCTAssertEqual([self doQuery], 8);
+    {
+        Transaction trans(database);
+        IndexWriter writer(index, trans);
+        std::vector<slice> docIDs;
+        docIDs.push_back(slice("WA"));
+        docIDs.push_back(slice("OR"));
+        docIDs.push_back(slice("NV"));  // not in the index yet
+        writer.preloadDocs(docIDs);
+        [self updateDoc: @"OR" body: @[@"Oregon", @"Portland", @"Walla Walla", @"Salem"]
+                 writer: writer];
+        [self updateDoc: @"NV" body: @[@"Nevada", @"Reno"] writer: writer];
+        [self updateDoc: @"WA" body: @[@"Washington", @"Seattle"] writer: writer];
+    }
+    XCTAssertEqual([self doQuery], 8);
+}
+
+- (void) testBulkLoad {
+    NSLog(@"--- Bulk load index");
+    {
+        // Use a tiny run size so the loader has to spill and merge several runs:
+        IndexBulkLoader loader(index, 200);
+        for (int i = 0; i < 100; i++) {
+            char docID[20], keyStr[20];
+            sprintf(docID, "doc-%03d", i);
+            sprintf(keyStr, "key-%03d", (i * 37) % 100);
+            std::vector<Collatable> keys;
+            std::vector<alloc_slice> values;
+            keys.push_back(Collatable(keyStr));
+            values.push_back(alloc_slice("value"));
+            keys.push_back(Collatable("common"));
+            values.push_back(alloc_slice("x"));
+            Assert(loader.add(slice(docID), i+1, keys, values, _rowCount));
+        }
+        AssertEq(_rowCount, 200u);
+        Transaction trans(database);
+        loader.finish(trans);
+    }
+    XCTAssertEqual([self doQuery], 200);
+
+    // The per-doc key lists must be usable by IndexWriter for later updates:
+    {
+        Transaction trans(database);
+        IndexWriter writer(index, trans);
+        [self updateDoc: @"doc-042" body: @[@"v", @"zzz"] writer: writer];
+    }
+    XCTAssertEqual([self doQuery], 199);
+}
+
 - (void) testBlockScopedObjects {
     boolBlock block = scopedEnumerate();
     while (block()) {
@@ -9,7 +9,9 @@
 #import <XCTest/XCTest.h>
 #import "testutil.h"
 #import "MapReduceIndex.hh"
+#import "MapReduceParallelIndexer.hh"
 #import "Collatable.hh"
+#import "Tokenizer.hh"
 
 using namespace forestdb;
 
@@ -58,6 +60,15 @@ public:
 
 int TestMapFn::numMapCalls;
 
+class FullTextMapFn : public MapFn {
+public:
+    virtual void operator() (const Mappable& mappable, EmitFn& emit) {
+        NSDictionary* body = ((TestJSONMappable&)mappable).body;
+        if (body[@"text"])
+            emit.emitTextTokens(nsstring_slice(body[@"text"]), forestdb::slice::null);
+    }
+};
+
 class TestIndexer : public MapReduceIndexer {
 public:
     static bool updateIndex(Database* database, MapReduceIndex* index) {
@@ -72,6 +83,35 @@ public:
     }
 };
 
+class TestParallelIndexer : public MapReduceParallelIndexer {
+public:
+    TestParallelIndexer(unsigned threadCount)   :MapReduceParallelIndexer(threadCount) { }
+
+    virtual void addDocument(const Document& doc) {
+        TestJSONMappable mappable(doc);
+        addMappable(mappable);
+    }
+};
+
+class TestPipelinedIndexer : public MapReducePipelinedIndexer {
+public:
+    TestPipelinedIndexer()   :MapReducePipelinedIndexer(3, 2) { }
+
+    virtual void addDocument(const Document& doc) {
+        TestJSONMappable mappable(doc);
+        addMappable(mappable);
+    }
+};
+
+// Only indexes docs with even sequence numbers; addDocument is allowed to skip docs.
+class SkippingPipelinedIndexer : public TestPipelinedIndexer {
+public:
+    virtual void addDocument(const Document& doc) {
+        if (doc.sequence() % 2 == 0)
+            TestPipelinedIndexer::addDocument(doc);
+    }
+};
+
 
 @interface MapReduce_Test : XCTestCase
 @end
@@ -212,4 +252,251 @@ public:
     AssertEq(index->lastSequenceChangedAt(), lastChangedAt);
 }
 
+- (void) testParallelIndexer {
+    [self createDocsAndIndex];
+
+    // A second index on the same source, stored in its own database:
+    std::string dbPath2 = PathForDatabaseNamed(@"forest_temp2.fdb");
+    Database* db2 = new Database(dbPath2, TestDBConfig());
+    MapReduceIndex* index2 = new MapReduceIndex(db2, "index", source);
+    {
+        Transaction trans(db2);
+        index2->setup(trans, 0, new TestMapFn, "1");
+    }
+
+    {
+        TestParallelIndexer indexer(2);
+        indexer.addIndex(index, new Transaction(db));
+        indexer.addIndex(index2, new Transaction(db2));
+        XCTAssertTrue(indexer.run());
+    }
+    AssertEq(index->rowCount(), 8u);
+    AssertEq(index2->rowCount(), 8u);
+    AssertEq(index2->lastSequenceIndexed(), index->lastSequenceIndexed());
+
+    delete index2;
+    db2->deleteDatabase();
+    delete db2;
+}
+
+- (void) testPipelinedIndexer {
+    [self createDocsAndIndex];
+    {
+        // Add enough docs to fill the (tiny) queues between stages:
+        Transaction trans(db);
+        for (int i = 0; i < 100; ++i) {
+            NSString* docID = [NSString stringWithFormat: @"doc-%03d", i];
+            NSDictionary* body = @{@"name": docID, @"cities": @[docID]};
+            trans.set(nsstring_slice(docID), forestdb::slice::null, JSONToData(body,NULL));
+        }
+    }
+    {
+        TestPipelinedIndexer indexer;
+        indexer.addIndex(index, new Transaction(db));
+        XCTAssertTrue(indexer.run());
+    }
+    AssertEq(index->rowCount(), 108u);
+    AssertEq(index->lastSequenceIndexed(), source.lastSequence());
+}
+
+- (void) testPipelinedIndexerSkippingDocs {
+    [self createDocsAndIndex];
+    {
+        Transaction trans(db);
+        for (int i = 0; i < 100; ++i) {
+            NSString* docID = [NSString stringWithFormat: @"doc-%03d", i];
+            NSDictionary* body = @{@"name": docID, @"cities": @[docID]};
+            trans.set(nsstring_slice(docID), forestdb::slice::null, JSONToData(body,NULL));
+        }
+    }
+    {
+        // Docs that are never mapped mustn't hold up the ones after them:
+        SkippingPipelinedIndexer indexer;
+        indexer.addIndex(index, new Transaction(db));
+        XCTAssertTrue(indexer.run());
+    }
+    Assert(index->rowCount() >= 50u && index->rowCount() < 108u);
+    AssertEq(index->lastSequenceIndexed(), source.lastSequence() - 1); // last one is odd
+}
+
+- (void) testShardedIndex {
+    [self createDocsAndIndex];
+    {
+        Transaction trans(db);
+        for (int i = 0; i < 100; ++i) {
+            NSString* docID = [NSString stringWithFormat: @"doc-%03d", i];
+            NSDictionary* body = @{@"name": docID, @"cities": @[docID, @"Anytown"]};
+            trans.set(nsstring_slice(docID), forestdb::slice::null, JSONToData(body,NULL));
+        }
+    }
+    XCTAssertTrue(TestIndexer::updateIndex(db, index));
+
+    // Three shards of the same index, each in its own database so they're written in parallel:
+    static const unsigned kShards = 3;
+    std::vector<Database*> shardDBs;
+    std::vector<Index*> shards;
+    {
+        TestParallelIndexer indexer(kShards);
+        for (unsigned i = 0; i < kShards; ++i) {
+            NSString* name = [NSString stringWithFormat: @"forest_shard%u.fdb", i];
+            Database* shardDB = new Database(PathForDatabaseNamed(name), TestDBConfig());
+            MapReduceIndex* shard = new MapReduceIndex(shardDB, "index", source);
+            {
+                Transaction trans(shardDB);
+                shard->setup(trans, 0, new TestMapFn, "1", 0, i, kShards);
+            }
+            indexer.addIndex(shard, new Transaction(shardDB));
+            shardDBs.push_back(shardDB);
+            shards.push_back(shard);
+        }
+        XCTAssertTrue(indexer.run());
+    }
+
+    uint64_t totalRows = 0;
+    for (unsigned i = 0; i < kShards; ++i) {
+        MapReduceIndex* shard = (MapReduceIndex*)shards[i];
+        AssertEq(shard->lastSequenceIndexed(), index->lastSequenceIndexed());
+        totalRows += shard->rowCount();
+        // Every row in a shard must come from a document that belongs to it:
+        for (IndexEnumerator e(shard, Collatable(), forestdb::slice::null,
+                               Collatable(), forestdb::slice::null,
+                               DocEnumerator::Options::kDefault); e.next(); ) {
+            AssertEq(MapReduceIndex::shardForDocID(e.docID(), kShards), i);
+        }
+    }
+    AssertEq(totalRows, index->rowCount());
+
+    // The merged shards should enumerate exactly like the unsharded index, in both directions
+    // and with a skip and limit:
+    DocEnumerator::Options options = DocEnumerator::Options::kDefault;
+    for (int pass = 0; pass < 3; ++pass) {
+        options.descending = (pass == 1);
+        if (pass == 2) {
+            options.skip = 5;
+            options.limit = 50;
+        }
+        IndexEnumerator e(index, Collatable(), forestdb::slice::null,
+                          Collatable(), forestdb::slice::null, options);
+        MergedIndexEnumerator m(shards, Collatable(), forestdb::slice::null,
+                                Collatable(), forestdb::slice::null, options);
+        unsigned nRows = 0;
+        while (e.next()) {
+            XCTAssertTrue(m.next());
+            AssertEqual((NSString*)e.key().readString(), (NSString*)m.key().readString());
+            Assert(e.docID() == m.docID());
+            Assert(e.value() == m.value());
+            ++nRows;
+        }
+        XCTAssertFalse(m.next());
+        AssertEq(nRows, (pass == 2) ? 50u : (unsigned)index->rowCount());
+    }
+
+    for (unsigned i = 0; i < kShards; ++i) {
+        delete shards[i];
+        shardDBs[i]->deleteDatabase();
+        delete shardDBs[i];
+    }
+}
+
+- (NSArray*) fullTextQuery: (NSString*)text mode: (FullTextQuery::Mode)mode distance: (unsigned)distance {
+    FullTextQuery query(index, nsstring_slice(text), mode, distance);
+    NSMutableArray* docIDs = [NSMutableArray array];
+    auto matches = query.run();
+    for (auto m = matches.begin(); m != matches.end(); ++m) {
+        XCTAssert(!m->positions.empty());
+        [docIDs addObject: (NSString*)m->docID];
+    }
+    return docIDs;
+}
+
+- (void) testFullTextQuery {
+    {
+        NSDictionary* data = @{
+               @"a": @{@"text": @"The quick brown fox jumps over the lazy dog"},
+               @"b": @{@"text": @"A lazy brown dog sleeps; the fox is quick"},
+               @"c": @{@"text": @"Foxes are quicker than dogs"}};
+        Transaction trans(db);
+        for (NSString* docID in data)
+            trans.set(nsstring_slice(docID), forestdb::slice::null, JSONToData(data[docID],NULL));
+    }
+    {
+        Transaction trans(db);
+        index->setup(trans, 0, new FullTextMapFn, "1");
+    }
+    XCTAssertTrue(TestIndexer::updateIndex(db, index));
+
+    AssertEqual([self fullTextQuery: @"fox quick" mode: FullTextQuery::kAllTerms distance: 0],
+                (@[@"a", @"b"]));
+    AssertEqual([self fullTextQuery: @"quick brown fox" mode: FullTextQuery::kPhrase distance: 0],
+                (@[@"a"]));
+    AssertEqual([self fullTextQuery: @"brown dog" mode: FullTextQuery::kPhrase distance: 0],
+                (@[@"b"]));
+    AssertEqual([self fullTextQuery: @"fox dog" mode: FullTextQuery::kNear distance: 3],
+                (@[@"b"]));
+    AssertEqual([self fullTextQuery: @"fox dog" mode: FullTextQuery::kNear distance: 4],
+                (@[@"a", @"b"]));
+    AssertEqual([self fullTextQuery: @"fox*" mode: FullTextQuery::kAllTerms distance: 0],
+                (@[@"a", @"b", @"c"]));
+    AssertEqual([self fullTextQuery: @"quick* than" mode: FullTextQuery::kPhrase distance: 0],
+                (@[@"c"]));
+    AssertEqual([self fullTextQuery: @"cat" mode: FullTextQuery::kAllTerms distance: 0],
+                (@[]));
+
+    // The match positions locate the words in the original text:
+    FullTextQuery query(index, forestdb::slice("quick brown fox"), FullTextQuery::kPhrase);
+    auto matches = query.run();
+    AssertEq(matches.size(), (size_t)1);
+    auto &match = matches[0];
+    AssertEq(match.positions.size(), (size_t)3);
+    NSString* text = (NSString*)index->readFullText(match.docID, match.docSequence,
+                                                    match.fullTextID);
+    AssertEqual(text, @"The quick brown fox jumps over the lazy dog");
+    AssertEq(match.positions[0].word, 1u);
+    AssertEq(match.positions[0].offset, 4u);
+    AssertEq(match.positions[2].offset, 16u);
+    AssertEq(match.positions[2].length, 3u);
+}
+
+- (void) testFullTextStopwords {
+    // With the English stemmer, stopwords aren't indexed, but they still take up word positions:
+    std::string savedStemmer = Tokenizer::defaultStemmer;
+    Tokenizer::defaultStemmer = "english";
+    {
+        NSDictionary* data = @{
+               @"a": @{@"text": @"The king of England"},
+               @"b": @{@"text": @"King England"},
+               @"c": @{@"text": @"Kings ruling over England"}};
+        Transaction trans(db);
+        for (NSString* docID in data)
+            trans.set(nsstring_slice(docID), forestdb::slice::null, JSONToData(data[docID],NULL));
+    }
+    {
+        Transaction trans(db);
+        index->setup(trans, 0, new FullTextMapFn, "1");
+    }
+    XCTAssertTrue(TestIndexer::updateIndex(db, index));
+
+    AssertEqual([self fullTextQuery: @"king england" mode: FullTextQuery::kAllTerms distance: 0],
+                (@[@"a", @"b", @"c"]));
+    AssertEqual([self fullTextQuery: @"king of england" mode: FullTextQuery::kPhrase distance: 0],
+                (@[@"a"]));
+    AssertEqual([self fullTextQuery: @"king england" mode: FullTextQuery::kPhrase distance: 0],
+                (@[@"b"]));
+    AssertEqual([self fullTextQuery: @"king england" mode: FullTextQuery::kNear distance: 0],
+                (@[@"b"]));
+    AssertEqual([self fullTextQuery: @"king england" mode: FullTextQuery::kNear distance: 1],
+                (@[@"a", @"b"]));
+    AssertEqual([self fullTextQuery: @"king england" mode: FullTextQuery::kNear distance: 2],
+                (@[@"a", @"b", @"c"]));
+
+    // The stopwords are counted in the match positions:
+    FullTextQuery query(index, forestdb::slice("king of england"), FullTextQuery::kPhrase);
+    auto matches = query.run();
+    AssertEq(matches.size(), (size_t)1);
+    AssertEq(matches[0].positions.size(), (size_t)2);
+    AssertEq(matches[0].positions[0].word, 1u);
+    AssertEq(matches[0].positions[1].word, 3u);
+    Tokenizer::defaultStemmer = savedStemmer;
+}
+
 @end
@@ -75,5 +75,67 @@ using namespace forestdb;
                           (@[@"seven", @"nine"]));
 }
 
+- (void)testTokenSet {
+    TokenSet tokens;
+    bool isNew;
+    for (int pass = 0; pass < 2; ++pass) {
+        // Insert enough tokens to make the hash table grow a few times:
+        for (unsigned i = 0; i < 1000; ++i) {
+            std::string token = std::to_string(i);
+            XCTAssertEqual(tokens.insert(slice(token), isNew), i);
+            XCTAssert(isNew);
+        }
+        XCTAssertEqual(tokens.size(), 1000u);
+        for (unsigned i = 0; i < 1000; i += 7) {
+            std::string token = std::to_string(i);
+            XCTAssertEqual(tokens.insert(slice(token), isNew), i);
+            XCTAssert(!isNew);
+            XCTAssert(tokens[i] == slice(token));
+        }
+        tokens.clear();
+        XCTAssertEqual(tokens.size(), 0u);
+    }
+}
+
+- (void)testPooledTokenizer {
+    {
+        PooledTokenizer english = Tokenizer::borrow("english", true);
+        const Tokenizer *borrowed = &*english;
+        const Tokenizer *returned;
+        {
+            // While one is checked out, another borrower gets a different one:
+            PooledTokenizer english2 = Tokenizer::borrow("english", true);
+            returned = &*english2;
+            XCTAssertNotEqual(borrowed, returned);
+        }
+        // ...and once that's returned, it's reused:
+        XCTAssertEqual(&*Tokenizer::borrow("english", true), returned);
+        XCTAssert(Tokenizer::borrow("english", true, "-")->tokenChars() == "-");
+    }
+
+    // Stem many words concurrently, each thread with its own borrowed tokenizer; the results must
+    // match stemming them one at a time:
+    std::string text;
+    for (int i = 0; i < 50; i++)
+        text += "Running jumpers happily connected generously organizations ";
+    std::vector<std::string> expected;
+    {
+        PooledTokenizer english = Tokenizer::borrow("english", true);
+        for (TokenIterator iter(*english, slice(text), false); iter; ++iter)
+            expected.push_back(iter.token());
+    }
+    XCTAssertEqual(expected.size(), (size_t)300);
+    XCTAssert(expected[0] == "run");
+    dispatch_apply(8, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t n) {
+        for (int i = 0; i < 100; i++) {
+            PooledTokenizer english = Tokenizer::borrow("english", true);
+            std::vector<std::string> tokens;
+            for (TokenIterator iter(*english, slice(text), false); iter; ++iter)
+                tokens.push_back(iter.token());
+            XCTAssert(tokens == expected);
+        }
+    });
+}
+
 
 @end
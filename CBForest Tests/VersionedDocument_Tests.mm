@@ -144,4 +144,55 @@ static revidBuffer stringToRev(NSString* str) {
     }
 }
 
+// Adds `count` revisions in a linear chain descending from `parent`; returns the last one.
+static const Revision* addChain(RevTree &tree, const Revision *parent, unsigned branch,
+                                unsigned count)
+{
+    unsigned gen = parent ? parent->revID.generation() : 0;
+    for (unsigned i = 0; i < count; ++i) {
+        char revStr[32];
+        sprintf(revStr, "%u-%04x%04x", ++gen, branch, i);
+        revidBuffer revID((forestdb::slice(revStr)));
+        int httpStatus;
+        parent = tree.insert(revID, forestdb::slice("{}"), false, false, parent, true, httpStatus);
+    }
+    return parent;
+}
+
+- (void) test05_PruneDeepTree {
+    RevTree tree;
+    addChain(tree, NULL, 0, 10000);
+    alloc_slice encoded = tree.encode();
+    [self measureBlock: ^{
+        RevTree t(encoded, 1, 0);
+        AssertEq(t.prune(20), 9980u);
+        AssertEq(t.size(), 20u);
+        AssertEq(t.currentRevision()->revID.generation(), 10000u);
+    }];
+}
+
+- (void) test06_PruneBranchyTree {
+    // 100 branches of 99 revs each, sprouting from a 100-rev trunk:
+    RevTree tree;
+    const Revision* trunk = addChain(tree, NULL, 0, 100);
+    revidBuffer trunkID = trunk->revID;
+    for (unsigned b = 1; b <= 100; ++b)
+        addChain(tree, tree.get(trunkID), b, 99);
+    AssertEq(tree.size(), 10000u);
+    AssertEq(tree.currentRevisions().size(), 100u);
+    alloc_slice encoded = tree.encode();
+    [self measureBlock: ^{
+        RevTree t(encoded, 1, 0);
+        AssertEq(t.prune(50), 100u*49 + 100);
+        AssertEq(t.size(), 100u*50);
+        AssertEq(t.currentRevisions().size(), 100u);
+    }];
+
+    // Purging a branch removes just its own revs, not the shared trunk:
+    RevTree t(encoded, 1, 0);
+    const Revision* leaf = t.currentRevisions()[0];
+    AssertEq(t.purge(leaf->revID), 99);
+    AssertEq(t.size(), 10000u - 99);
+}
+
 @end
@@ -17,6 +17,14 @@
 #include "Collatable.hh"
 #include "varint.hh"
 #include "LogInternal.hh"
+#include <algorithm>
+#include <limits.h>
+#include <queue>
+#include <sstream>
+#include <iomanip> // std::setprecision
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 
 namespace forestdb {
@@ -28,50 +36,488 @@ namespace forestdb {
     }
 
     Index::Index(Database* db, std::string name)
-    :KeyStore(db, name)
+    :KeyStore(db, name),
+     _database(db),
+     _docs(db, name + "::docs"),
+     _aggregateLevels(0)
     { }
 
+    void Index::setAggregateLevels(unsigned levels) {
+        _aggregateLevels = levels;
+        if (levels > 0)
+            _aggregates = KeyStore(_database, name() + "::aggregates");
+    }
+
+    void Index::deleteStores() {
+        if (_aggregateLevels > 0)
+            _database->deleteKeyStore(_aggregates.name());
+        _database->deleteKeyStore(_docs.name());
+        _database->deleteKeyStore(name());
+    }
+
+    void Index::eraseAll(Transaction& t) {
+        KeyStore::erase(t);
+        _docs.erase(t);
+        if (_aggregateLevels > 0)
+            _aggregates.erase(t);
+    }
+
     IndexWriter::IndexWriter(Index* index, Transaction& t)
-    :KeyStoreWriter(*index, t)
+    :KeyStoreWriter(*index, t),
+     _index(index),
+     _docsWriter(index->_docs, t),
+     _aggregatesWriter(index->_aggregates, t)
     {
         CBFAssert(t.database()->contains(*index));
     }
 
 
-    // djb2 hash function:
-    static const uint32_t kInitialHash = 5381;
-    static inline void addHash(uint32_t &hash, slice value) {
-        for (auto i = 0; i < value.size; ++i)
-            hash = ((hash << 5) + hash) + value[i];
+#pragma mark - ROW KEYS:
+
+
+    // Emit#s are stored at the end of row keys (see rowKey) as ordered ints, which are much
+    // shorter than Collatable numbers.
+
+    static const size_t kMaxOrderedUIntLen = 9;
+
+    // Writes an unsigned int in a form that sorts by value: a byte count followed by the
+    // big-endian bytes, without leading zeroes. Returns the end of what was written.
+    static uint8_t* putOrderedUInt(uint8_t* dst, uint64_t n) {
+        uint8_t bytes[8];
+        unsigned len = 0;
+        for (; n > 0; n >>= 8)
+            bytes[len++] = (uint8_t)n;
+        *dst++ = (uint8_t)len;
+        while (len > 0)
+            *dst++ = bytes[--len];
+        return dst;
     }
 
-    void IndexWriter::getKeysForDoc(slice docID, std::vector<Collatable> &keys, uint32_t &hash) {
-        Document doc = get(docID);
-        if (doc.body().size > 0) {
-            CollatableReader reader(doc.body());
-            hash = (uint32_t)reader.readInt();
-            while (!reader.atEnd()) {
-                keys.push_back( Collatable(reader.read(), true) );
+
+#pragma mark - AGGREGATES:
+
+
+    bool RowAggregate::numericValue(slice value, double &outNumber) {
+        if (value.size > 0 && (value[0] == Collatable::kNegative
+                               || value[0] == Collatable::kPositive)) {
+            outNumber = CollatableReader(value).readDouble();
+            return true;
+        }
+
+        // Otherwise it should be a JSON number (strtod also accepts things JSON doesn't, like
+        // "inf" or hex, so check the first character.)
+        char buf[64];
+        if (value.size > 0 && value.size < sizeof(buf)) {
+            memcpy(buf, value.buf, value.size);
+            buf[value.size] = '\0';
+            const char *start = buf + strspn(buf, " \t\r\n");
+            const char *digit = (*start == '-') ? start + 1 : start;
+            if (*digit >= '0' && *digit <= '9') {
+                char *end;
+                double n = strtod(start, &end);
+                if (end[strspn(end, " \t\r\n")] == '\0') {
+                    outNumber = n;
+                    return true;
+                }
             }
+        }
+        return false;
+    }
+
+    void RowAggregate::addValue(slice value, int delta) {
+        count += delta;
+        double n;
+        if (numericValue(value, n))
+            sum += delta * n;
+        else
+            nonNumeric += delta;
+    }
+
+    RowAggregate& RowAggregate::operator+= (const RowAggregate &a) {
+        count += a.count;
+        nonNumeric += a.nonNumeric;
+        sum += a.sum;
+        return *this;
+    }
+
+    // Returns the start of an array key through its first `level` items, without the array's end
+    // tag; or the entire key if it isn't an array.
+    static slice keyPrefix(slice key, unsigned level) {
+        CollatableReader reader(key);
+        if (reader.peekTag() != CollatableTypes::kArray)
+            return key;
+        reader.beginArray();
+        for (unsigned i = 0; i < level && reader.peekTag() != CollatableTypes::kEndSequence; ++i)
+            reader.read();
+        return slice(key.buf, key.size - reader.data().size);
+    }
+
+    // The key's group at a level: its prefix, closed again if it's an array. The keys in a group
+    // are contiguous, and groups sort in the same order as their keys.
+    static std::string keyGroup(slice key, unsigned level) {
+        slice prefix = keyPrefix(key, level);
+        std::string group((const char*)prefix.buf, prefix.size);
+        if (prefix.size < key.size)
+            group.push_back((char)CollatableTypes::kEndSequence);
+        return group;
+    }
+
+    // Appended to a key prefix, this byte sorts after every key with that prefix (as in
+    // makeRealKey), since no Collatable tag is that high.
+    static const char kEllipsis = (char)0xFF;
+
+    // The last possible key in a group (inclusive.) If the group is an array that might have been
+    // truncated, that's its items followed by kEllipsis, which sorts after any further item,
+    // including maps and geohashes.
+    static std::string lastKeyInGroup(slice group, unsigned level) {
+        CollatableReader reader(group);
+        if (reader.peekTag() != CollatableTypes::kArray)
+            return (std::string)group;
+        reader.beginArray();
+        unsigned items = 0;
+        while (reader.peekTag() != CollatableTypes::kEndSequence) {
+            reader.read();
+            ++items;
+        }
+        if (items < level)
+            return (std::string)group;                  // the entire key
+        std::string last((const char*)group.buf, group.size - 1);   // without the end tag
+        last.push_back(kEllipsis);
+        return last;
+    }
+
+    // Aggregate entries are keyed by [level, group]:
+    static Collatable aggregateKey(unsigned level, slice group) {
+        Collatable key;
+        key.beginArray() << level;
+        if (group.buf)
+            key << Collatable(group, true);
+        key.endArray();
+        return key;
+    }
+
+    // Besides its groups, every key is counted in a "bucket" at each depth 1...kBucketDepth: its
+    // first `depth` bytes (or the entire key, if it's shorter.) Buckets sort in the same order as
+    // their keys, and each splits into at most 256 buckets at the next depth, so whatever the
+    // keys look like, a key range is covered by at most 2*256 whole buckets per depth plus the
+    // rows at its two ends that share their first kBucketDepth bytes with it.
+    static const unsigned kBucketDepth = 8;
+
+    static slice keyBucket(slice key, unsigned depth) {
+        return slice(key.buf, std::min(key.size, (size_t)depth));
+    }
+
+    // The first byte string after every key starting with a bucket (exclusive.) A bucket can end
+    // in the middle of a number, so appending kEllipsis wouldn't do; instead the bucket's last
+    // byte is incremented. (The first byte is a tag, so it's never 0xFF.)
+    static std::string bucketEnd(slice bucket) {
+        std::string end = (std::string)bucket;
+        while (!end.empty() && (uint8_t)end.back() == 0xFF)
+            end.pop_back();
+        if (!end.empty())
+            end.back() = (char)((uint8_t)end.back() + 1);
+        return end;
+    }
+
+    // Bucket entries are keyed by [-depth, bucket], which sort before all the groups:
+    static Collatable bucketKey(unsigned depth, slice bucket) {
+        Collatable key;
+        key.beginArray() << -(double)depth;
+        if (bucket.buf)
+            key << Collatable(bucket, true);
+        key.endArray();
+        return key;
+    }
+
+    // ...and their values are [count, sum, nonNumeric]:
+    static Collatable encodeAggregate(const RowAggregate &a) {
+        Collatable value;
+        value.beginArray() << (double)a.count << a.sum << (double)a.nonNumeric;
+        value.endArray();
+        return value;
+    }
+
+    static RowAggregate decodeAggregate(slice body) {
+        RowAggregate a;
+        if (body.size > 0) {
+            CollatableReader reader(body);
+            reader.beginArray();
+            a.count = reader.readInt();
+            a.sum = reader.readDouble();
+            a.nonNumeric = reader.readInt();
+        }
+        return a;
+    }
+
+    // Adds a row to (or with delta=-1, removes it from) the totals of its group at every level.
+    static void addToAggregates(std::map<std::string, RowAggregate> &aggregates, unsigned levels,
+                                slice key, slice value, int delta)
+    {
+        RowAggregate row;
+        row.addValue(value, delta);
+        for (unsigned level = 1; level <= levels; ++level) {
+            Collatable aggKey = aggregateKey(level, slice(keyGroup(key, level)));
+            aggregates[(std::string)slice(aggKey)] += row;
+        }
+        for (unsigned depth = 1; depth <= kBucketDepth; ++depth) {
+            Collatable aggKey = bucketKey(depth, keyBucket(key, depth));
+            aggregates[(std::string)slice(aggKey)] += row;
+        }
+    }
+
+    void IndexWriter::addToAggregates(slice key, slice value, int delta) {
+        forestdb::addToAggregates(_aggregateDeltas, _index->_aggregateLevels, key, value, delta);
+    }
+
+    void IndexWriter::saveAggregates() {
+        for (auto d = _aggregateDeltas.begin(); d != _aggregateDeltas.end(); ++d) {
+            if (d->second.count == 0 && d->second.nonNumeric == 0 && d->second.sum == 0.0)
+                continue;
+            slice key(d->first);
+            RowAggregate total = decodeAggregate(_aggregatesWriter.get(key).body());
+            total += d->second;
+            if (total.count > 0)
+                _aggregatesWriter.set(key, encodeAggregate(total));
+            else
+                _aggregatesWriter.del(key);
+        }
+        _aggregateDeltas.clear();
+    }
+
+    // Adds up the stored aggregates of the buckets at a depth strictly between two buckets, either
+    // of which may be null to leave that end open.
+    RowAggregate Index::reduceBuckets(unsigned depth, slice startBucket, slice endBucket) {
+        // [-depth] sorts before every bucket at the depth, and [-depth+0.5] after them all:
+        Collatable startKey = bucketKey(depth, startBucket);
+        Collatable endKey;
+        if (endBucket.buf) {
+            endKey = bucketKey(depth, endBucket);
         } else {
-            hash = kInitialHash;
+            endKey.beginArray() << (-(double)depth + 0.5);
+            endKey.endArray();
+        }
+        DocEnumerator::Options options = DocEnumerator::Options::kDefault;
+        options.inclusiveStart = options.inclusiveEnd = false;
+        RowAggregate total;
+        for (DocEnumerator e(_aggregates, startKey, endKey, options); e.next(); )
+            total += decodeAggregate(e->body());
+        return total;
+    }
+
+    // Reduces the rows in a key range, using the aggregates at each depth for the buckets that
+    // are entirely inside the range, and descending to the next depth for the buckets at the two
+    // ends. Below the last depth the remaining rows are read. Empty keys are open ends.
+    RowAggregate Index::reduceRange(slice startKey, bool inclusiveStart,
+                                    slice endKey, bool inclusiveEnd,
+                                    unsigned depth)
+    {
+        RowAggregate total;
+        if (startKey.size > 0 && endKey.size > 0) {
+            int cmp = startKey.compare(endKey);
+            if (cmp > 0 || (cmp == 0 && !(inclusiveStart && inclusiveEnd)))
+                return total;   // empty range
+        }
+
+        if (depth > kBucketDepth) {
+            // The bounds may be truncated keys (see bucketEnd), which IndexEnumerator's key
+            // bounds can't express exactly, so it's given inclusive bounds and the keys are
+            // compared bytewise here:
+            IndexEnumerator rows(this,
+                                 Collatable(startKey, true), slice::null,
+                                 Collatable(endKey, true), slice::null,
+                                 DocEnumerator::Options::kDefault);
+            while (rows.next()) {
+                slice key = rows._key;
+                if (startKey.size > 0) {
+                    int cmp = key.compare(startKey);
+                    if (cmp < 0 || (cmp == 0 && !inclusiveStart))
+                        continue;
+                }
+                if (endKey.size > 0) {
+                    int cmp = key.compare(endKey);
+                    if (cmp > 0 || (cmp == 0 && !inclusiveEnd))
+                        break;
+                }
+                total.addValue(rows.value());
+            }
+            return total;
+        }
+
+        slice startBucket, endBucket;
+        if (startKey.size > 0)
+            startBucket = keyBucket(startKey, depth);
+        if (endKey.size > 0)
+            endBucket = keyBucket(endKey, depth);
+        if (startKey.size > 0 && endKey.size > 0 && startBucket == endBucket) {
+            if (startBucket.size < depth) {
+                // Both ends are this entire key, and the range includes it:
+                return decodeAggregate(_aggregates.get(bucketKey(depth, startBucket)).body());
+            }
+            return reduceRange(startKey, inclusiveStart, endKey, inclusiveEnd, depth + 1);
+        }
+
+        total = reduceBuckets(depth, startBucket, endBucket);
+        if (startKey.size > 0) {
+            if (startBucket.size < depth)
+                total += reduceRange(startKey, inclusiveStart, startKey, true, depth + 1);
+            else
+                total += reduceRange(startKey, inclusiveStart,
+                                     slice(bucketEnd(startBucket)), false,
+                                     depth + 1);
+        }
+        if (endKey.size > 0)
+            total += reduceRange(endBucket, true,
+                                 endKey, inclusiveEnd,
+                                 depth + 1);
+        return total;
+    }
+
+
+    // Hash of an emitted value, stored in the back-index so that an unchanged row can be detected
+    // without reading it. This is MurmurHash64A, which digests 8 bytes at a time. (Loads are in
+    // native byte order, so a file moved to a different-endian CPU will just see all values as
+    // changed the next time they're indexed.)
+    // kSpecialValue is a placeholder for the entire doc and always considered changed, so its
+    // hash is 0, which never matches anything.
+    static uint64_t rowHash(slice value) {
+        if (value == Index::kSpecialValue)
+            return 0;
+        const uint64_t m = 0xc6a4a7935bd1e995ull;
+        const int r = 47;
+        uint64_t h = 0x8445d61a4e774912ull ^ (value.size * m);
+        const uint8_t* data = (const uint8_t*)value.buf;
+        const uint8_t* end = data + (value.size & ~(size_t)7);
+        for (; data < end; data += 8) {
+            uint64_t k;
+            memcpy(&k, data, 8);
+            k *= m;
+            k ^= k >> r;
+            k *= m;
+            h ^= k;
+            h *= m;
+        }
+        switch (value.size & 7) {
+            case 7: h ^= (uint64_t)data[6] << 48;
+            case 6: h ^= (uint64_t)data[5] << 40;
+            case 5: h ^= (uint64_t)data[4] << 32;
+            case 4: h ^= (uint64_t)data[3] << 24;
+            case 3: h ^= (uint64_t)data[2] << 16;
+            case 2: h ^= (uint64_t)data[1] << 8;
+            case 1: h ^= (uint64_t)data[0];
+                    h *= m;
+        }
+        h ^= h >> r;
+        h *= m;
+        h ^= h >> r;
+        return h ? h : 1;
+    }
+
+    // The key of an index row combines the emitted key, docID, and emit#: an array tag (which
+    // keeps rows after the index's state entry), the Collatable key and Collatable docID, then the
+    // emit# (if nonzero) as an ordered int. Since Collatables are self-delimiting, rows sort by
+    // emitted key first, then by docID, just as the array [key, docID, emit#] would.
+    static alloc_slice rowKey(slice key, slice collatableDocID, unsigned emitIndex) {
+        alloc_slice realKey(1 + key.size + collatableDocID.size + kMaxOrderedUIntLen);
+        uint8_t* dst = (uint8_t*)realKey.buf;
+        *dst++ = CollatableTypes::kArray;
+        memcpy(dst, key.buf, key.size);
+        dst += key.size;
+        memcpy(dst, collatableDocID.buf, collatableDocID.size);
+        dst += collatableDocID.size;
+        if (emitIndex > 0)
+            dst = putOrderedUInt(dst, emitIndex);
+        realKey.size = dst - (uint8_t*)realKey.buf;
+        return realKey;
+    }
+
+    // The back-index entry stored under a doc's ID lists the keys emitted for it and their rows'
+    // value hashes. Format: the number of keys as a varint, then each hash as 8 little-endian
+    // bytes, then the keys as a sequence of Collatables.
+    static alloc_slice encodeDocKeys(const std::vector<Collatable> &keys,
+                                     const std::vector<uint64_t> &hashes)
+    {
+        Collatable keyData;
+        for (auto i=keys.begin(); i != keys.end(); ++i)
+            keyData << *i;
+        alloc_slice result(kMaxVarintLen64 + 8*hashes.size() + keyData.size());
+        uint8_t* dst = (uint8_t*)result.buf;
+        dst += PutUVarInt(dst, hashes.size());
+        for (auto h = hashes.begin(); h != hashes.end(); ++h)
+            for (unsigned i = 0; i < 8; ++i)
+                *dst++ = (uint8_t)(*h >> (8*i));
+        memcpy(dst, slice(keyData).buf, keyData.size());
+        dst += keyData.size();
+        result.size = dst - (uint8_t*)result.buf;
+        return result;
+    }
+
+    void IndexWriter::preloadDocs(std::vector<slice> docIDs) {
+        std::vector<std::string> keys;
+        keys.reserve(docIDs.size());
+        for (auto docID = docIDs.begin(); docID != docIDs.end(); ++docID) {
+            Collatable collatableDocID;
+            collatableDocID << *docID;
+            keys.push_back((std::string)slice(collatableDocID));
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+        for (DocEnumerator e(_docsWriter, keys); e.next(); ) {
+            const Document& doc = e.doc();
+            _preloaded[(std::string)doc.key()] = alloc_slice(doc.body());
         }
     }
 
-    void IndexWriter::setKeysForDoc(slice docID, const std::vector<Collatable> &keys, uint32_t hash) {
-        if (keys.size() > 0) {
-            Collatable writer;
-            writer << hash;
-            for (auto i=keys.begin(); i != keys.end(); ++i)
-                writer << *i;
-            set(docID, writer);
+    static void decodeDocKeys(slice body, std::vector<Collatable> &keys,
+                              std::vector<uint64_t> &hashes)
+    {
+        if (body.size == 0)
+            return;
+        uint64_t count;
+        if (!ReadUVarInt(&body, &count) || body.size < 8*count)
+            throw error(error::CorruptIndexData);
+        const uint8_t* src = (const uint8_t*)body.buf;
+        for (uint64_t n = 0; n < count; ++n) {
+            uint64_t h = 0;
+            for (unsigned i = 0; i < 8; ++i)
+                h |= (uint64_t)*src++ << (8*i);
+            hashes.push_back(h);
+        }
+        body.moveStart(8*count);
+        CollatableReader reader(body);
+        while (!reader.atEnd()) {
+            keys.push_back( Collatable(reader.read(), true) );
+        }
+        if (keys.size() != count)
+            throw error(error::CorruptIndexData);
+    }
+
+    void IndexWriter::getKeysForDoc(slice docID, std::vector<Collatable> &keys,
+                                    std::vector<uint64_t> &hashes)
+    {
+        auto preloaded = _preloaded.find((std::string)docID);
+        if (preloaded != _preloaded.end()) {
+            // Use it only once, since update() is about to change the stored keys:
+            alloc_slice body = preloaded->second;
+            _preloaded.erase(preloaded);
+            decodeDocKeys(body, keys, hashes);
         } else {
-            del(docID);
+            decodeDocKeys(_docsWriter.get(docID).body(), keys, hashes);
         }
     }
 
+    void IndexWriter::setKeysForDoc(slice docID, const std::vector<Collatable> &keys,
+                                    const std::vector<uint64_t> &hashes)
+    {
+        if (keys.size() > 0)
+            _docsWriter.set(docID, encodeDocKeys(keys, hashes));
+        else
+            _docsWriter.del(docID);
+    }
+
     bool IndexWriter::update(slice docID, sequence docSequence,
-                             std::vector<Collatable> keys, std::vector<alloc_slice> values,
+                             const std::vector<Collatable> &keys,
+                             const std::vector<alloc_slice> &values,
                              uint64_t &rowCount)
     {
         Collatable collatableDocID;
@@ -81,95 +527,98 @@ namespace forestdb {
         uint8_t metaBuf[10];
         slice meta(metaBuf, PutUVarInt(metaBuf, docSequence));
 
-        // Get the previously emitted keys:
+        // Get the previously emitted keys and the hashes of their values:
         std::vector<Collatable> oldStoredKeys, newStoredKeys;
-        uint32_t oldStoredHash;
-        getKeysForDoc(collatableDocID, oldStoredKeys, oldStoredHash);
-
-        // Compute a hash of the values and see whether it's the same as the previous values' hash:
-        uint32_t newStoredHash = kInitialHash;
-        for (auto value = values.begin(); value != values.end(); ++value) {
-            if (*value == Index::kSpecialValue) {
-                // kSpecialValue is placeholder for entire doc, and always considered changed.
-                oldStoredHash = newStoredHash - 1; // force comparison to fail
-                break;
-            }
-            addHash(newStoredHash, *value);
-        }
-        bool valuesMightBeUnchanged = (newStoredHash == oldStoredHash);
+        std::vector<uint64_t> oldStoredHashes, newStoredHashes;
+        getKeysForDoc(collatableDocID, oldStoredKeys, oldStoredHashes);
 
         bool keysChanged = false;
         int64_t rowsRemoved = 0, rowsAdded = 0;
+        std::vector<bool> overwritten(oldStoredKeys.size());
+        bool aggregating = (_index->_aggregateLevels > 0);
 
         auto value = values.begin();
         unsigned emitIndex = 0;
         auto oldKey = oldStoredKeys.begin();
         for (auto key = keys.begin(); key != keys.end(); ++key,++value,++emitIndex) {
-            // Create a key for the index db by combining the emitted key, doc ID, and emit#:
-            Collatable realKey;
-            realKey.beginArray() << *key << collatableDocID;
-            if (emitIndex > 0)
-                realKey << emitIndex;
-            realKey.endArray();
-            if (realKey.size() > Document::kMaxKeyLength
+            // Create a key for the index db by combining the emitted key, docID, and emit#:
+            alloc_slice realKey = rowKey(*key, collatableDocID, emitIndex);
+            if (realKey.size > Document::kMaxKeyLength
                     || value->size > Document::kMaxBodyLength) {
                 Warn("Index key or value too long"); //FIX: Need more-official warning
                 continue;
             }
+            uint64_t hash = rowHash(*value);
 
             // Is this a key that was previously emitted last time we indexed this document?
             if (keysChanged || oldKey == oldStoredKeys.end() || !(*oldKey == *key)) {
                 // no; note that the set of keys is different
                 keysChanged = true;
             } else {
-                // yes
+                // yes; if the value's hash is the same too, the row is unchanged:
+                uint64_t oldHash = oldStoredHashes[oldKey - oldStoredKeys.begin()];
                 ++oldKey;
-                if (valuesMightBeUnchanged) {
-                    // read the old row so we can compare the value too:
-                    Document oldRow = get(realKey);
-                    if (oldRow.exists()) {
-                        if (oldRow.body() == *value) {
-                            Log("Old k/v pair (%s, %s) unchanged",
-                                key->toJSON().c_str(), ((std::string)*value).c_str());
-                            continue;  // Value is unchanged, so this is a no-op; skip to next key!
-                        }
-                    } else {
-                        Warn("Old emitted k/v pair unexpectedly missing");
-                    }
+                newStoredKeys.push_back(*key);
+                newStoredHashes.push_back(hash);
+                if (hash != 0 && hash == oldHash) {
+                    Log("Old k/v pair (%s, %s) unchanged",
+                        key->toJSON().c_str(), ((std::string)*value).c_str());
+                    continue;  // Value is unchanged, so this is a no-op; skip to next key!
                 }
                 ++rowsRemoved;  // more like "overwritten"
+                if (aggregating)
+                    addToAggregates(*key, get(realKey).body(), -1);
+                set(realKey, meta, *value);
+                if (aggregating)
+                    addToAggregates(*key, *value, 1);
+                ++rowsAdded;
+                continue;
+            }
+
+            // The same key may have been emitted at this index last time even though an earlier
+            // key differed; then this overwrites that row, which mustn't be deleted below:
+            if (emitIndex < oldStoredKeys.size() && oldStoredKeys[emitIndex] == *key) {
+                overwritten[emitIndex] = true;
+                ++rowsRemoved;
+                if (aggregating)
+                    addToAggregates(*key, get(realKey).body(), -1);
             }
 
             // Store the key & value:
-            Log("**** update: realKey = %s", realKey.toJSON().c_str());
+            Log("**** update: key = %s, docID = %s", key->toJSON().c_str(), ((std::string)docID).c_str());
             set(realKey, meta, *value);
             newStoredKeys.push_back(*key);
+            newStoredHashes.push_back(hash);
+            if (aggregating)
+                addToAggregates(*key, *value, 1);
             ++rowsAdded;
         }
 
         // If there are any old keys that weren't emitted this time, we need to delete those rows:
         for (; oldKey != oldStoredKeys.end(); ++oldKey) {
-            Collatable realKey;
-            realKey.beginArray() << *oldKey << collatableDocID;
-            auto oldEmitIndex = oldKey - oldStoredKeys.begin();
-            if (oldEmitIndex > 0)
-                realKey << oldEmitIndex;
-            realKey.endArray();
+            auto oldEmitIndex = (unsigned)(oldKey - oldStoredKeys.begin());
+            keysChanged = true;
+            if (overwritten[oldEmitIndex])
+                continue;
+            alloc_slice realKey = rowKey(*oldKey, collatableDocID, oldEmitIndex);
+            if (aggregating)
+                addToAggregates(*oldKey, get(realKey).body(), -1);
             bool deleted = del(realKey);
             if (!deleted) {
                 Warn("Failed to delete old emitted k/v pair");
             }
             ++rowsRemoved;
-            keysChanged = true;
         }
 
-        // Store the keys that were emitted for this doc, and the hash of the values:
-        if (keysChanged)
-            setKeysForDoc(collatableDocID, newStoredKeys, newStoredHash);
-
         if (rowsRemoved==0 && rowsAdded==0)
             return false;
 
+        if (aggregating)
+            saveAggregates();
+
+        // Store the keys that were emitted for this doc, and the hashes of the values:
+        setKeysForDoc(collatableDocID, newStoredKeys, newStoredHashes);
+
         rowCount += rowsAdded - rowsRemoved;
         return true;
     }
@@ -181,47 +630,314 @@ namespace forestdb {
         collatableDocID << docID;
 
         // realKey matches the key generated in update(), above
-        Collatable realKey;
-        realKey.beginArray();
-        realKey << key << collatableDocID;
-        if (emitIndex > 0)
-            realKey << emitIndex;
-        realKey.endArray();
+        alloc_slice realKey = rowKey(key, collatableDocID, emitIndex);
 
-        Log("**** getEntry: realKey = %s", realKey.toJSON().c_str());
+        Log("**** getEntry: key = %s, docID = %s", key.toJSON().c_str(), ((std::string)docID).c_str());
         Document doc = get(realKey);
         CBFAssert(doc.exists());
         return alloc_slice(doc.body());
     }
 
 
+#pragma mark - BULK LOADER:
+
+
+    /** Sorts key/meta/value entries by key, spilling sorted runs to temporary files when they
+        grow too large, and finally merges them into a KeyStore. */
+    class IndexBulkLoader::Sorter {
+    public:
+        explicit Sorter(size_t maxRunSize)
+        :_maxRunSize(maxRunSize), _runSize(0)
+        { }
+
+        ~Sorter() {
+            for (auto f = _runs.begin(); f != _runs.end(); ++f)
+                fclose(*f);
+        }
+
+        void add(slice key, slice meta, slice value) {
+            Entry entry;
+            entry.data = alloc_slice(key.size + meta.size + value.size);
+            entry.keySize = (uint32_t)key.size;
+            entry.metaSize = (uint32_t)meta.size;
+            uint8_t* dst = (uint8_t*)entry.data.buf;
+            memcpy(dst, key.buf, key.size);
+            memcpy(dst + key.size, meta.buf, meta.size);
+            memcpy(dst + key.size + meta.size, value.buf, value.size);
+            _entries.push_back(entry);
+            _runSize += entry.data.size + sizeof(Entry);
+            if (_runSize >= _maxRunSize)
+                spill();
+        }
+
+        void writeTo(KeyStoreWriter &writer) {
+            forEach([&](slice key, slice meta, slice value) {
+                writer.set(key, meta, value);
+            });
+        }
+
+        // Calls fn(key, meta, value) for every entry, in key order.
+        template <class FN>
+        void forEach(FN fn) {
+            if (_runs.empty()) {
+                // Everything fit in memory:
+                sortEntries();
+                for (auto e = _entries.begin(); e != _entries.end(); ++e)
+                    fn(e->key(), e->meta(), e->value());
+                _entries.clear();
+                return;
+            }
+
+            // Merge the runs, always passing on the lowest key at the head of any run:
+            spill();
+            std::vector<Entry> heads(_runs.size());
+            auto greater = [&heads](size_t a, size_t b) {return heads[b].key() < heads[a].key();};
+            std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> queue(greater);
+            for (size_t i = 0; i < _runs.size(); ++i) {
+                rewind(_runs[i]);
+                if (readEntry(_runs[i], heads[i]))
+                    queue.push(i);
+            }
+            while (!queue.empty()) {
+                size_t i = queue.top();
+                queue.pop();
+                fn(heads[i].key(), heads[i].meta(), heads[i].value());
+                if (readEntry(_runs[i], heads[i]))
+                    queue.push(i);
+            }
+        }
+
+    private:
+        struct Entry {
+            alloc_slice data;               // key, meta and value, concatenated
+            uint32_t keySize, metaSize;
+
+            slice key() const   {return slice(data.buf, keySize);}
+            slice meta() const  {return slice((uint8_t*)data.buf + keySize, metaSize);}
+            slice value() const {return slice((uint8_t*)data.buf + keySize + metaSize,
+                                              data.size - keySize - metaSize);}
+        };
+
+        void sortEntries() {
+            std::sort(_entries.begin(), _entries.end(), [](const Entry &a, const Entry &b) {
+                return a.key() < b.key();
+            });
+        }
+
+        // Sorts the buffered entries and writes them to a new temporary file.
+        void spill() {
+            if (_entries.empty())
+                return;
+            sortEntries();
+            FILE* f = tmpfile();
+            if (!f)
+                error::_throw(FDB_RESULT_OPEN_FAIL);
+            _runs.push_back(f);
+            for (auto e = _entries.begin(); e != _entries.end(); ++e) {
+                uint8_t header[3*kMaxVarintLen32];
+                size_t headerSize = PutUVarInt(header, e->keySize);
+                headerSize += PutUVarInt(header + headerSize, e->metaSize);
+                headerSize += PutUVarInt(header + headerSize, e->data.size);
+                if (fwrite(header, headerSize, 1, f) != 1
+                        || fwrite(e->data.buf, e->data.size, 1, f) != 1)
+                    error::_throw(FDB_RESULT_WRITE_FAIL);
+            }
+            _entries.clear();
+            _runSize = 0;
+            Log("IndexBulkLoader: Spilled sorted run #%zu", _runs.size());
+        }
+
+        static bool readVarInt(FILE* f, uint64_t &n) {
+            n = 0;
+            for (unsigned shift = 0; shift < 64; shift += 7) {
+                int c = getc(f);
+                if (c == EOF)
+                    return false;
+                n |= (uint64_t)(c & 0x7F) << shift;
+                if ((c & 0x80) == 0)
+                    return true;
+            }
+            throw error(error::CorruptIndexData);
+        }
+
+        static bool readEntry(FILE* f, Entry &entry) {
+            uint64_t keySize, metaSize, size;
+            if (!readVarInt(f, keySize))
+                return false;   // end of run
+            if (!readVarInt(f, metaSize) || !readVarInt(f, size) || keySize + metaSize > size)
+                throw error(error::CorruptIndexData);
+            entry.data = alloc_slice((size_t)size);
+            entry.keySize = (uint32_t)keySize;
+            entry.metaSize = (uint32_t)metaSize;
+            if (size > 0 && fread((void*)entry.data.buf, (size_t)size, 1, f) != 1)
+                error::_throw(FDB_RESULT_READ_FAIL);
+            return true;
+        }
+
+        const size_t _maxRunSize;
+        size_t _runSize;
+        std::vector<Entry> _entries;
+        std::vector<FILE*> _runs;
+    };
+
+
+    IndexBulkLoader::IndexBulkLoader(Index* index, size_t maxRunSize)
+    :_index(index),
+     _rows(new Sorter(maxRunSize)),
+     _docs(new Sorter(maxRunSize / 4)),
+     _aggregateRuns(new Sorter(maxRunSize / 4)),
+     _maxAggregates(maxRunSize / 256)      // a map node takes roughly that many bytes
+    { }
+
+    IndexBulkLoader::~IndexBulkLoader()
+    { }
+
+    bool IndexBulkLoader::add(slice docID, sequence docSequence,
+                              const std::vector<Collatable> &keys,
+                              const std::vector<alloc_slice> &values,
+                              uint64_t &rowCount)
+    {
+        Collatable collatableDocID;
+        collatableDocID << docID;
+
+        // Metadata of emitted rows contains doc sequence as varint:
+        uint8_t metaBuf[10];
+        slice meta(metaBuf, PutUVarInt(metaBuf, docSequence));
+
+        // Same as IndexWriter::update, minus all the comparisons with the previous rows:
+        std::vector<Collatable> storedKeys;
+        std::vector<uint64_t> storedHashes;
+        auto value = values.begin();
+        unsigned emitIndex = 0;
+        for (auto key = keys.begin(); key != keys.end(); ++key,++value,++emitIndex) {
+            alloc_slice realKey = rowKey(*key, collatableDocID, emitIndex);
+            if (realKey.size > Document::kMaxKeyLength
+                    || value->size > Document::kMaxBodyLength) {
+                Warn("Index key or value too long"); //FIX: Need more-official warning
+                continue;
+            }
+            _rows->add(realKey, meta, *value);
+            if (_index->_aggregateLevels > 0) {
+                addToAggregates(_aggregates, _index->_aggregateLevels, *key, *value, 1);
+                if (_aggregates.size() >= _maxAggregates)
+                    spillAggregates();
+            }
+            storedKeys.push_back(*key);
+            storedHashes.push_back(rowHash(*value));
+        }
+        if (storedKeys.empty())
+            return false;
+
+        _docs->add(collatableDocID, slice::null, encodeDocKeys(storedKeys, storedHashes));
+        rowCount += storedKeys.size();
+        return true;
+    }
+
+    void IndexBulkLoader::finish(Transaction& t) {
+        KeyStoreWriter writer(*_index, t);
+        _rows->writeTo(writer);
+        KeyStoreWriter docsWriter(_index->_docs, t);
+        _docs->writeTo(docsWriter);
+        if (_index->_aggregateLevels > 0) {
+            // The partial totals come out of the sorter in key order, so the ones for the same
+            // aggregate are adjacent and can be added up as they go by:
+            spillAggregates();
+            KeyStoreWriter aggWriter(_index->_aggregates, t);
+            std::string aggKey;
+            RowAggregate total;
+            _aggregateRuns->forEach([&](slice key, slice meta, slice value) {
+                if (key != slice(aggKey)) {
+                    if (total.count > 0)
+                        aggWriter.set(slice(aggKey), encodeAggregate(total));
+                    aggKey = (std::string)key;
+                    total = RowAggregate();
+                }
+                total += decodeAggregate(value);
+            });
+            if (total.count > 0)
+                aggWriter.set(slice(aggKey), encodeAggregate(total));
+        }
+    }
+
+    // Moves the aggregate totals accumulated in memory into the sorter, which spills them to disk
+    // as they pile up. finish() adds together the partial totals of each aggregate.
+    void IndexBulkLoader::spillAggregates() {
+        for (auto a = _aggregates.begin(); a != _aggregates.end(); ++a)
+            _aggregateRuns->add(slice(a->first), slice::null, encodeAggregate(a->second));
+        _aggregates.clear();
+    }
+
+
+#pragma mark - TEXT POSTINGS:
+
+
+    void TextPostings::encode(std::string &out) const {
+        uint8_t buf[3 * kMaxVarintLen32];
+        out.append((const char*)buf, PutUVarInt(buf, fullTextID));
+        out.append((const char*)buf, PutUVarInt(buf, positions.size()));
+        uint32_t word = 0, offset = 0;
+        for (auto pos = positions.begin(); pos != positions.end(); ++pos) {
+            size_t n = PutUVarInt(buf, pos->word - word);
+            n += PutUVarInt(buf + n, pos->offset - offset);
+            n += PutUVarInt(buf + n, pos->length);
+            out.append((const char*)buf, n);
+            word = pos->word;
+            offset = pos->offset;
+        }
+    }
+
+    bool TextPostings::decode(slice data) {
+        positions.clear();
+        uint64_t n, count;
+        if (!ReadUVarInt(&data, &n) || !ReadUVarInt(&data, &count) || count > data.size)
+            return false;
+        fullTextID = (unsigned)n;
+        positions.reserve((size_t)count);
+        Position pos = {0, 0, 0};
+        for (uint64_t i = 0; i < count; ++i) {
+            uint64_t wordDelta, offsetDelta, length;
+            if (!ReadUVarInt(&data, &wordDelta) || !ReadUVarInt(&data, &offsetDelta)
+                    || !ReadUVarInt(&data, &length))
+                return false;
+            pos.word += (uint32_t)wordDelta;
+            pos.offset += (uint32_t)offsetDelta;
+            pos.length = (uint32_t)length;
+            positions.push_back(pos);
+        }
+        return data.size == 0;
+    }
+
+
 #pragma mark - ENUMERATOR:
 
 
-    // Converts an index key into the actual key used in the index db (key + docID)
-    static Collatable makeRealKey(Collatable key, slice docID, bool isEnd, bool descending) {
+    // Converts an index key into the actual key used in the index db (key + docID).
+    static alloc_slice makeRealKey(Collatable key, slice docID, bool isEnd, bool descending) {
         bool addEllipsis = (isEnd != descending);
         if (key.empty() && addEllipsis)
-            return Collatable();
-        Collatable realKey;
-        realKey.beginArray();
-        if (!key.empty()) {
-            realKey << key;
-            if (docID.buf)
-                realKey << docID;
-        }
-        if (addEllipsis) {
-            realKey.beginMap();
-            realKey.endMap();
-        }
-        realKey.endArray();
+            return alloc_slice();
+        Collatable collatableDocID;
+        if (!key.empty() && docID.buf)
+            collatableDocID << docID;
+        alloc_slice realKey(1 + key.size() + collatableDocID.size() + 1);
+        uint8_t* dst = (uint8_t*)realKey.buf;
+        *dst++ = CollatableTypes::kArray;
+        memcpy(dst, slice(key).buf, key.size());
+        dst += key.size();
+        memcpy(dst, slice(collatableDocID).buf, collatableDocID.size());
+        dst += collatableDocID.size();
+        if (addEllipsis)
+            *dst++ = 0xFF;      // sorts after any docID or emit#
+        realKey.size = dst - (uint8_t*)realKey.buf;
         return realKey;
     }
 
     static DocEnumerator::Options docOptions(DocEnumerator::Options options) {
         options.limit = DocEnumerator::Options::kDefault.limit;
         options.skip = DocEnumerator::Options::kDefault.skip;
-        options.contentOptions = KeyStore::kDefaultContent; // read() method needs the doc bodies
+        // read() method needs the doc bodies, unless the caller only wants keys:
+        options.contentOptions = (KeyStore::contentOptions)(options.contentOptions
+                                                             & KeyStore::kMetaOnly);
         return options;
     }
 
@@ -235,8 +951,8 @@ namespace forestdb {
      _inclusiveEnd(options.inclusiveEnd),
      _currentKeyIndex(-1),
      _dbEnum(*_index,
-             (slice)makeRealKey(startKey, startKeyDocID, false, options.descending),
-             (slice)makeRealKey(endKey,   endKeyDocID,   true,  options.descending),
+             makeRealKey(startKey, startKeyDocID, false, options.descending),
+             makeRealKey(endKey,   endKeyDocID,   true,  options.descending),
              docOptions(options))
     {
         Debug("IndexEnumerator(%p)", this);
@@ -246,42 +962,108 @@ namespace forestdb {
             _endKey = (slice)endKey;
     }
 
+    // Sorts key ranges and merges the ones that overlap or touch, then puts them in enumeration
+    // order, so that an enumerator never has to seek backwards or read a row twice.
+    static std::vector<KeyRange> normalizeKeyRanges(std::vector<KeyRange> ranges, bool descending) {
+        std::sort(ranges.begin(), ranges.end(), [](const KeyRange &a, const KeyRange &b) {
+            int cmp = slice(a.start).compare(b.start);
+            if (cmp != 0)
+                return cmp < 0;
+            return slice(a.end) < slice(b.end);
+        });
+        std::vector<KeyRange> merged;
+        for (auto r = ranges.begin(); r != ranges.end(); ++r) {
+            if (!merged.empty()) {
+                KeyRange &last = merged.back();
+                int cmp = slice(r->start).compare(last.end);
+                if (cmp <= 0) {
+                    // r starts inside (or right at the end of) the last range, so extend that:
+                    int endCmp = slice(r->end).compare(last.end);
+                    if (endCmp > 0) {
+                        last.end = r->end;
+                        last.inclusiveEnd = r->inclusiveEnd;
+                    } else if (endCmp == 0) {
+                        last.inclusiveEnd = last.inclusiveEnd || r->inclusiveEnd;
+                    }
+                    continue;
+                }
+            }
+            merged.push_back(*r);
+        }
+        if (descending)
+            std::reverse(merged.begin(), merged.end());
+        return merged;
+    }
+
     IndexEnumerator::IndexEnumerator(Index* index,
                                      std::vector<KeyRange> keyRanges,
-                                     const DocEnumerator::Options& options)
+                                     const DocEnumerator::Options& options,
+                                     bool inCallerOrder)
     :_index(index),
      _options(options),
      _inclusiveStart(true),
      _inclusiveEnd(true),
-     _keyRanges(keyRanges),
+     _keyRanges(normalizeKeyRanges(keyRanges, options.descending)),
      _currentKeyIndex(-1),
+     _rowsRead(false),
+     _callerIndex(0), _rowIndex(0), _rowEnd(0),
+     _callerSkip(0), _callerLimit(0),
      _dbEnum(*_index, slice::null, slice::null, docOptions(options))
     {
         Debug("IndexEnumerator(%p), key ranges:", this);
         for (auto i = _keyRanges.begin(); i != _keyRanges.end(); ++i)
             Debug("    key range: %s -- %s (%d)", i->start.toJSON().c_str(), i->end.toJSON().c_str(), i->inclusiveEnd);
-        nextKeyRange();
+        if (inCallerOrder) {
+            // Skip and limit will apply to the reordered rows, not to the sorted ones:
+            _callerRanges = keyRanges;
+            _callerSkip = _options.skip;
+            _callerLimit = _options.limit;
+            _options.skip = DocEnumerator::Options::kDefault.skip;
+            _options.limit = DocEnumerator::Options::kDefault.limit;
+        }
+        if (_keyRanges.empty()) {
+            _dbEnum.close();
+        } else {
+            _currentKeyIndex = 0;
+            seekToKeyRange();
+        }
+    }
+
+    // Is the key beyond the current key range, in the direction of enumeration?
+    bool IndexEnumerator::isPastKeyRange(slice key) const {
+        const KeyRange &range = _keyRanges[_currentKeyIndex];
+        if (_options.descending)
+            return key < range.start;
+        else
+            return range.isKeyPastEnd(key);
+    }
+
+    // Has the enumeration reached the current key range, i.e. is the key not before it?
+    bool IndexEnumerator::hasReachedKeyRange(slice key) const {
+        const KeyRange &range = _keyRanges[_currentKeyIndex];
+        if (_options.descending)
+            return range.inclusiveEnd ? !(key > range.end) : key < range.end;
+        else
+            return !(key < range.start);
     }
 
     bool IndexEnumerator::read() {
         while(true) {
-            if (!_dbEnum) {
-                if (_currentKeyIndex < 0)
-                    return false; // at end
-                else {
-                    nextKeyRange();
-                    if (_dbEnum.next())
-                        continue;
-                    else
-                        return false;
-                }
-            }
+            if (!_dbEnum)
+                return false; // at end (key ranges are sorted, so no later range has any rows)
             
             const Document& doc = _dbEnum.doc();
 
-            // Decode the key from collatable form:
-            CollatableReader keyReader(doc.key());
-            keyReader.beginArray();
+            // Decode the key from collatable form (see rowKey):
+            _rowKey = doc.key();
+            slice rest = _rowKey;
+            if (rest.size == 0 || rest[0] != CollatableTypes::kArray) {
+                // The state entry sorts before all the rows, so this is the end:
+                _dbEnum.close();
+                return false;
+            }
+            rest.moveStart(1);
+            CollatableReader keyReader(rest);
             _key = keyReader.read();
 
             if (!_inclusiveEnd && _key == _endKey) {
@@ -292,18 +1074,34 @@ namespace forestdb {
                 continue;
             }
 
-            if (_currentKeyIndex >= 0 && _keyRanges[_currentKeyIndex].isKeyPastEnd(_key)) {
-                // While enumerating through _keys, advance to the next key:
-                nextKeyRange();
-                if (_dbEnum.next())
-                    continue;
-                else
-                    return false;
+            if (_currentKeyIndex >= 0 && isPastKeyRange(_key)) {
+                // While enumerating through key ranges, advance to the next range. If this row
+                // is already in it, keep going from here; otherwise seek (always forwards) to it:
+                do {
+                    if (++_currentKeyIndex >= (int)_keyRanges.size()) {
+                        _dbEnum.close();
+                        return false;
+                    }
+                } while (isPastKeyRange(_key));
+                if (!hasReachedKeyRange(_key)) {
+                    seekToKeyRange();
+                    if (_dbEnum.next())
+                        continue;
+                    else
+                        return false;
+                }
             }
 
-            _docID = keyReader.readString();
-            GetUVarInt(doc.meta(), &_sequence);
-            _value = doc.body();
+            if (_options.contentOptions & KeyStore::kMetaOnly) {
+                // Only keys are wanted (e.g. for counting), so don't decode the rest:
+                _docID = alloc_slice();
+                _sequence = 0;
+                _value = slice::null;
+            } else {
+                _docID = keyReader.readString();
+                GetUVarInt(doc.meta(), &_sequence);
+                _value = doc.body();
+            }
 
             // Subclasses can ignore rows:
             if (!this->approve(_key)) {
@@ -330,33 +1128,435 @@ namespace forestdb {
     }
 
     std::vector<size_t> IndexEnumerator::getTextTokenInfo(unsigned &fullTextID) {
-        CollatableReader reader(value());
-        reader.beginArray();
-        fullTextID = (unsigned)reader.readInt();
+        TextPostings postings;
+        if (!getTextPostings(postings))
+            throw error(error::CorruptIndexData);
+        fullTextID = postings.fullTextID;
         std::vector<size_t> tokens;
-        do {
-            tokens.push_back((size_t)reader.readInt());
-            tokens.push_back((size_t)reader.readInt());
-        } while (reader.peekTag() != CollatableReader::kEndSequence);
+        tokens.reserve(2 * postings.positions.size());
+        for (auto pos = postings.positions.begin(); pos != postings.positions.end(); ++pos) {
+            tokens.push_back(pos->offset);
+            tokens.push_back(pos->length);
+        }
         return tokens;
     }
 
-    void IndexEnumerator::nextKeyRange() {
-        if (++_currentKeyIndex >= _keyRanges.size()) {
-            _dbEnum.close();
-            return;
-        }
-
-        Collatable& startKey = _keyRanges[_currentKeyIndex].start;
-        Debug("IndexEnumerator: Advance to key '%s'", startKey.toJSON().c_str());
+    // Positions the DocEnumerator at the first row of the current key range: its start, or when
+    // descending, just after its end (or at its end, if that's exclusive.)
+    void IndexEnumerator::seekToKeyRange() {
+        const KeyRange &range = _keyRanges[_currentKeyIndex];
+        alloc_slice seekKey;
+        if (_options.descending)
+            seekKey = makeRealKey(range.end, slice::null, range.inclusiveEnd, false);
+        else
+            seekKey = makeRealKey(range.start, slice::null, false, false);
+        Debug("IndexEnumerator: Advance to key '%s'",
+              (_options.descending ? range.end : range.start).toJSON().c_str());
         if (!_dbEnum)
             _dbEnum = DocEnumerator(*_index, slice::null, slice::null, docOptions(_options));
-        _dbEnum.seek(makeRealKey(startKey, slice::null, false, _options.descending));
+        _dbEnum.seek(seekKey);
     }
 
     bool IndexEnumerator::next() {
+        if (!_callerRanges.empty())
+            return nextInCallerOrder();
         _dbEnum.next();
         return read();
     }
 
+    // Finds the buffered rows in a key range. Since the rows are buffered in sorted order, they're
+    // contiguous.
+    void IndexEnumerator::findBufferedRows(const KeyRange &range) {
+        auto below = [&](const Row &row) {return slice(row.key) < range.start;};
+        auto above = [&](const Row &row) {return range.isKeyPastEnd(row.key);};
+        auto notBelow = [&](const Row &row) {return !below(row);};
+        auto notAbove = [&](const Row &row) {return !above(row);};
+        std::vector<Row>::iterator first, last;
+        if (_options.descending) {
+            first = std::partition_point(_rows.begin(), _rows.end(), above);
+            last = std::partition_point(first, _rows.end(), notBelow);
+        } else {
+            first = std::partition_point(_rows.begin(), _rows.end(), below);
+            last = std::partition_point(first, _rows.end(), notAbove);
+        }
+        _rowIndex = first - _rows.begin();
+        _rowEnd = last - _rows.begin();
+    }
+
+    // Reads more rows (in sorted order) into the buffer until it has all of a key range's rows,
+    // or at least `wanted` of them.
+    void IndexEnumerator::bufferRows(const KeyRange &range, size_t wanted) {
+        findBufferedRows(range);
+        size_t inRange = _rowEnd - _rowIndex;
+        while (!_rowsRead && inRange < wanted) {
+            if (!_rows.empty()) {
+                slice lastKey = _rows.back().key;
+                if (_options.descending ? (lastKey < range.start) : range.isKeyPastEnd(lastKey))
+                    break;      // already read past the end of the range
+            }
+            if (!(_dbEnum.next(), read())) {
+                _rowsRead = true;
+                break;
+            }
+            Row row;
+            row.key = alloc_slice(_key);
+            row.value = alloc_slice(_value);
+            row.docID = _docID;
+            row.sequence = _sequence;
+            _rows.push_back(row);
+            if (!(_key < range.start) && !range.isKeyPastEnd(_key))
+                ++inRange;
+        }
+        findBufferedRows(range);
+    }
+
+    // Returns the rows of each range given by the caller, in turn. The index is still read in a
+    // single pass in sorted order, buffering the rows, but only as far as the current range
+    // needs; reading stops once the rows to skip and return have all been found.
+    bool IndexEnumerator::nextInCallerOrder() {
+        while (true) {
+            if (_rowIndex >= _rowEnd) {
+                // Find the rows of the next range:
+                if (_callerIndex >= _callerRanges.size())
+                    return false;
+                size_t wanted = (size_t)_callerSkip + _callerLimit;
+                bufferRows(_callerRanges[_callerIndex++], wanted);
+                continue;
+            }
+
+            const Row &row = _rows[_rowIndex++];
+            if (_callerSkip > 0) {
+                --_callerSkip;
+                continue;
+            }
+            if (_callerLimit-- == 0) {
+                _rowIndex = _rowEnd = 0;
+                _callerIndex = _callerRanges.size();
+                _dbEnum.close();
+                return false;
+            }
+            _key = row.key;
+            _value = row.value;
+            _docID = row.docID;
+            _sequence = row.sequence;
+            return true;
+        }
+    }
+
+
+#pragma mark - MERGED ENUMERATOR:
+
+
+    // Each index's enumerator has to produce every row that could survive the merged skip and
+    // limit, so it gets no skip and a limit of skip+limit:
+    DocEnumerator::Options MergedIndexEnumerator::subOptions(const DocEnumerator::Options& options) {
+        DocEnumerator::Options sub = options;
+        sub.skip = 0;
+        if (options.limit > UINT_MAX - options.skip)
+            sub.limit = UINT_MAX;
+        else
+            sub.limit = options.skip + options.limit;
+        return sub;
+    }
+
+    MergedIndexEnumerator::MergedIndexEnumerator(std::vector<Index*> indexes,
+                                                 Collatable startKey, slice startKeyDocID,
+                                                 Collatable endKey, slice endKeyDocID,
+                                                 const DocEnumerator::Options& options)
+    :_hasRow(indexes.size(), false),
+     _started(false),
+     _descending(options.descending),
+     _skip(options.skip), _limit(options.limit),
+     _current(0)
+    {
+        DocEnumerator::Options sub = subOptions(options);
+        for (auto i = indexes.begin(); i != indexes.end(); ++i)
+            _enums.push_back(std::unique_ptr<IndexEnumerator>(
+                        new IndexEnumerator(*i, startKey, startKeyDocID, endKey, endKeyDocID, sub)));
+    }
+
+    MergedIndexEnumerator::MergedIndexEnumerator(std::vector<Index*> indexes,
+                                                 std::vector<KeyRange> keyRanges,
+                                                 const DocEnumerator::Options& options)
+    :_hasRow(indexes.size(), false),
+     _started(false),
+     _descending(options.descending),
+     _skip(options.skip), _limit(options.limit),
+     _current(0)
+    {
+        DocEnumerator::Options sub = subOptions(options);
+        for (auto i = indexes.begin(); i != indexes.end(); ++i)
+            _enums.push_back(std::unique_ptr<IndexEnumerator>(
+                        new IndexEnumerator(*i, keyRanges, sub)));
+    }
+
+    bool MergedIndexEnumerator::next() {
+        while (true) {
+            // Advance the enumerator whose row was returned last, or on the first call, all of them:
+            if (!_started) {
+                for (size_t i = 0; i < _enums.size(); ++i)
+                    _hasRow[i] = _enums[i]->next();
+                _started = true;
+            } else if (_current < _enums.size()) {
+                _hasRow[_current] = _enums[_current]->next();
+            }
+
+            // Pick the lowest (or highest, if descending) current row. There are few enough
+            // indexes that a linear scan beats maintaining a heap:
+            size_t best = _enums.size();
+            for (size_t i = 0; i < _enums.size(); ++i) {
+                if (!_hasRow[i])
+                    continue;
+                if (best == _enums.size()) {
+                    best = i;
+                } else {
+                    int cmp = _enums[i]->_rowKey.compare(_enums[best]->_rowKey);
+                    if (_descending ? (cmp > 0) : (cmp < 0))
+                        best = i;
+                }
+            }
+            _current = best;
+            if (best == _enums.size())
+                return false;
+
+            if (_skip > 0) {
+                --_skip;
+                continue;
+            }
+            if (_limit-- == 0) {
+                _hasRow.assign(_enums.size(), false);
+                _current = _enums.size();
+                return false;
+            }
+            return true;
+        }
+    }
+
+
+#pragma mark - REDUCE:
+
+
+    ReduceEnumerator::ReduceEnumerator(IndexEnumerator &rows,
+                                       ReduceType type,
+                                       bool group, unsigned groupLevel,
+                                       unsigned skip, unsigned limit)
+    :_rows(&rows),
+     _index(NULL),
+     _type(type),
+     _group(group || groupLevel > 0),
+     _groupLevel(groupLevel),
+     _skip(skip),
+     _limit(limit),
+     _started(false),
+     _hasRow(false),
+     _descending(false),
+     _inclusiveLow(true),
+     _inclusiveHigh(true)
+    { }
+
+    ReduceEnumerator::ReduceEnumerator(Index *index,
+                                       Collatable startKey, Collatable endKey,
+                                       const DocEnumerator::Options &options,
+                                       ReduceType type, unsigned groupLevel)
+    :_rows(NULL),
+     _index(index),
+     _type(type),
+     _group(groupLevel > 0),
+     _groupLevel(groupLevel),
+     _skip(options.skip),
+     _limit(options.limit),
+     _started(false),
+     _hasRow(false),
+     _descending(options.descending)
+    {
+        CBFAssert(canUseAggregates(index, type, _group, groupLevel));
+        // Keep the range in ascending order:
+        if (_descending) {
+            std::swap(startKey, endKey);
+            _inclusiveLow = options.inclusiveEnd;
+            _inclusiveHigh = options.inclusiveStart;
+        } else {
+            _inclusiveLow = options.inclusiveStart;
+            _inclusiveHigh = options.inclusiveEnd;
+        }
+        _lowKey = alloc_slice(startKey);
+        _highKey = alloc_slice(endKey);
+    }
+
+    bool ReduceEnumerator::canUseAggregates(const Index *index, ReduceType type,
+                                            bool group, unsigned groupLevel)
+    {
+        return index->aggregateLevels() > 0
+            && type != kStats                       // min and max can't be maintained
+            && (groupLevel > 0 || !group)           // exact grouping isn't a prefix level
+            && groupLevel <= index->aggregateLevels();
+    }
+
+    // Returns the part of a key that determines its group. For a group level, that's the array's
+    // start tag and first _groupLevel items (without the end tag); otherwise the entire key.
+    slice ReduceEnumerator::groupPrefix(slice key) const {
+        if (!_group)
+            return slice::null;
+        if (_groupLevel == 0)
+            return key;
+        return keyPrefix(key, _groupLevel);
+    }
+
+    double ReduceEnumerator::numericValue(slice value) {
+        double n;
+        if (!RowAggregate::numericValue(value, n))
+            throw error(error::InvalidReduceValue);
+        return n;
+    }
+
+    void ReduceEnumerator::setValue(uint64_t count, double sum,
+                                    double sumsqr, double min, double max)
+    {
+        std::stringstream out;
+        out << std::setprecision(16);
+        switch (_type) {
+            case kCount:
+                out << count;
+                break;
+            case kSum:
+                out << sum;
+                break;
+            case kStats:
+                out << "{\"sum\":" << sum << ",\"count\":" << count
+                    << ",\"min\":" << min << ",\"max\":" << max
+                    << ",\"sumsqr\":" << sumsqr << "}";
+                break;
+        }
+        _value = out.str();
+    }
+
+    bool ReduceEnumerator::next() {
+        if (_index)
+            return nextFromAggregates();
+
+        if (!_started) {
+            _started = true;
+            _hasRow = _rows->next();
+        }
+        while (_hasRow && _limit > 0) {
+            // The current row starts a new group; aggregate it and all following rows in it:
+            slice prefix = groupPrefix(_rows->key().data());
+            _groupPrefix.assign((const char*)prefix.buf, prefix.size);
+            bool skipping = (_skip > 0);
+            bool needValues = (_type != kCount && !skipping);
+            uint64_t count = 0;
+            double sum = 0.0, sumsqr = 0.0, min = 0.0, max = 0.0;
+            do {
+                if (needValues) {
+                    double n = numericValue(_rows->value());
+                    sum += n;
+                    sumsqr += n * n;
+                    if (count == 0 || n < min)
+                        min = n;
+                    if (count == 0 || n > max)
+                        max = n;
+                }
+                ++count;
+            } while ((_hasRow = _rows->next())
+                        && groupPrefix(_rows->key().data()) == slice(_groupPrefix));
+
+            if (skipping) {
+                --_skip;
+                continue;
+            }
+            --_limit;
+
+            if (!_group) {
+                _groupKey = (std::string)(slice)Collatable().addNull();
+            } else {
+                _groupKey = _groupPrefix;
+                if (_groupLevel > 0 && CollatableReader(slice(_groupKey)).peekTag() == kArray)
+                    _groupKey.push_back((char)kEndSequence);  // close the truncated array
+            }
+            setValue(count, sum, sumsqr, min, max);
+            return true;
+        }
+        _groupKey.clear();
+        _value.clear();
+        return false;
+    }
+
+    // Like next(), but using the index's aggregates: only the groups at the ends of the range have
+    // to be reduced (by Index::reduceRange), since the rest are entirely inside it.
+    bool ReduceEnumerator::nextFromAggregates() {
+        bool first = !_started;
+        if (first) {
+            _started = true;
+            if (_groupLevel > 0) {
+                if (_lowKey.size > 0)
+                    _lowGroup = keyGroup(_lowKey, _groupLevel);
+                if (_highKey.size > 0)
+                    _highGroup = keyGroup(_highKey, _groupLevel);
+                Collatable startKey = aggregateKey(_groupLevel,
+                                                   _lowKey.size > 0 ? slice(_lowGroup) : slice::null);
+                Collatable endKey;
+                if (_highKey.size > 0) {
+                    endKey = aggregateKey(_groupLevel, slice(_highGroup));
+                } else {
+                    endKey.beginArray() << (_groupLevel + 0.5);  // after every group at the level
+                    endKey.endArray();
+                }
+                DocEnumerator::Options options = DocEnumerator::Options::kDefault;
+                options.descending = _descending;
+                if (_descending)
+                    std::swap(startKey, endKey);
+                _groups = DocEnumerator(_index->_aggregates, startKey, endKey, options);
+            }
+        }
+
+        while (_limit > 0) {
+            RowAggregate total;
+            if (_groupLevel == 0) {
+                // Without grouping, the whole range reduces to a single row:
+                if (!first)
+                    break;
+                first = false;
+                total = _index->reduceRange(_lowKey, _inclusiveLow, _highKey, _inclusiveHigh, 1);
+                _groupKey = (std::string)(slice)Collatable().addNull();
+            } else {
+                if (!_groups.next())
+                    break;
+                CollatableReader reader(_groups->key());
+                reader.beginArray();
+                reader.read();  // skip level
+                slice group = reader.read();
+                _groupKey.assign((const char*)group.buf, group.size);
+
+                bool atLow = (_lowKey.size > 0 && _groupKey == _lowGroup);
+                bool atHigh = (_highKey.size > 0 && _groupKey == _highGroup);
+                if (atLow || atHigh) {
+                    // Only part of this group may be in range:
+                    std::string lastKey = lastKeyInGroup(group, _groupLevel);
+                    total = _index->reduceRange(atLow ? slice(_lowKey) : group,
+                                                atLow ? _inclusiveLow : true,
+                                                atHigh ? slice(_highKey) : slice(lastKey),
+                                                atHigh ? _inclusiveHigh : true,
+                                                1);
+                } else {
+                    total = decodeAggregate(_groups->body());
+                }
+            }
+
+            if (total.count <= 0)
+                continue;
+            if (_skip > 0) {
+                --_skip;
+                continue;
+            }
+            --_limit;
+            if (_type == kSum && total.nonNumeric > 0)
+                throw error(error::InvalidReduceValue);
+            setValue(total.count, total.sum, 0.0, 0.0, 0.0);
+            return true;
+        }
+        _groupKey.clear();
+        _value.clear();
+        return false;
+    }
+
 }
@@ -18,6 +18,9 @@
 
 #include "DocEnumerator.hh"
 #include "Collatable.hh"
+#include <map>
+#include <memory>
+#include <unordered_map>
 
 namespace forestdb {
     
@@ -38,6 +41,26 @@ namespace forestdb {
         bool operator== (const KeyRange &r)     {return start==r.start && end==r.end;}
     };
 
+
+
+    /** Totals of the values of a set of index rows; used for reduce aggregates. */
+    struct RowAggregate {
+        int64_t count;          // Number of rows
+        int64_t nonNumeric;     // Number of rows whose values aren't numbers
+        double sum;             // Sum of the numeric values
+
+        RowAggregate()                          :count(0), nonNumeric(0), sum(0.0) { }
+
+        /** Adds a row's value (delta = 1) or subtracts it (delta = -1). */
+        void addValue(slice value, int delta =1);
+
+        RowAggregate& operator+= (const RowAggregate&);
+
+        /** Interprets an index row's value as a number: either a JSON number or a Collatable-
+            encoded one. Returns false if it's anything else. */
+        static bool numericValue(slice value, double &outNumber);
+    };
+
     
     /** A key-value store used as an index. */
     class Index : protected KeyStore {
@@ -52,9 +75,45 @@ namespace forestdb {
             represents the entire document being indexed. */
         static const slice kSpecialValue;
 
+        /** The number of array-key prefix levels at which reduce aggregates are maintained, or 0
+            if there are none. At each level there's a running count and sum of the rows under
+            every distinct key prefix of that length (or key, for non-array keys), which lets
+            grouped reduces read one total per group. Along with them, the totals of
+            every leading-byte prefix of the keys are kept too, up to 8 bytes deep, so a range
+            reduce adds up at most a few hundred totals per byte plus the rows at its ends.
+            (Rows whose keys share their first 8 bytes with an end of the range are read one
+            by one, so ranges over long keys with a common prefix gain little.) */
+        unsigned aggregateLevels() const        {return _aggregateLevels;}
+
+        /** The name of the index's KeyStore in its Database. */
+        std::string name() const                {return KeyStore::name();}
+
+        /** Deletes the index's KeyStores from its Database, leaving any others in the file alone.
+            The Index can't be used afterwards. */
+        void deleteStores();
+
+    protected:
+        /** Starts maintaining aggregates at this many levels. Only valid on an empty index. */
+        void setAggregateLevels(unsigned levels);
+
+        /** Erases the index's rows along with its aggregates. */
+        void eraseAll(Transaction&);
+
     private:
+        RowAggregate reduceRange(slice startKey, bool inclusiveStart,
+                                 slice endKey, bool inclusiveEnd,
+                                 unsigned depth);
+        RowAggregate reduceBuckets(unsigned depth, slice startBucket, slice endBucket);
+
+        Database* _database;
+        KeyStore _docs;             // docID -> emitted keys & value hashes
+        KeyStore _aggregates;       // [level, group] or [-depth, key bytes] -> [count, sum, nonNumeric]
+        unsigned _aggregateLevels;
+
         friend class IndexWriter;
+        friend class IndexBulkLoader;
         friend class IndexEnumerator;
+        friend class ReduceEnumerator;
     };
 
 
@@ -68,20 +127,96 @@ namespace forestdb {
             Returns true if the index may have changed as a result. */
         bool update(slice docID,
                     sequence docSequence,
-                    std::vector<Collatable> keys,
-                    std::vector<alloc_slice> values,
+                    const std::vector<Collatable> &keys,
+                    const std::vector<alloc_slice> &values,
                     uint64_t &rowCount);
 
+        /** Reads the stored keys of many documents in one pass (in sorted order, for locality),
+            to save the update() calls for those documents from having to look them up one at a
+            time. Each preloaded entry is used by the next update() of its document. */
+        void preloadDocs(std::vector<slice> docIDs);
+
     private:
-        void getKeysForDoc(slice docID, std::vector<Collatable> &outKeys, uint32_t &outHash);
-        void setKeysForDoc(slice docID, const std::vector<Collatable> &keys, uint32_t hash);
+        void getKeysForDoc(slice docID, std::vector<Collatable> &outKeys,
+                           std::vector<uint64_t> &outHashes);
+        void setKeysForDoc(slice docID, const std::vector<Collatable> &keys,
+                           const std::vector<uint64_t> &hashes);
+        void addToAggregates(slice key, slice value, int delta);
+        void saveAggregates();
+
+        Index* _index;
+        KeyStoreWriter _docsWriter;
+        KeyStoreWriter _aggregatesWriter;
+        std::map<std::string, RowAggregate> _aggregateDeltas; // aggregate key -> change
+
+        std::unordered_map<std::string, alloc_slice> _preloaded; // Collatable docID -> stored keys
 
         friend class Index;
         friend class MapReduceIndex;
     };
 
 
-    /** Index query enumerator. */
+    /** Builds an index from scratch much faster than IndexWriter, by never reading old rows and
+        by writing everything in key order. Emitted rows are buffered in memory, sorted and spilled
+        to temporary files in runs of limited size; finish() then merges the runs into the index,
+        followed by the per-document key lists (sorted the same way.)
+        The index must be empty, and each document may only be added once. */
+    class IndexBulkLoader {
+    public:
+        static const size_t kDefaultMaxRunSize = 16*1024*1024;
+
+        explicit IndexBulkLoader(Index* index, size_t maxRunSize =kDefaultMaxRunSize);
+        ~IndexBulkLoader();
+
+        /** Adds a document's emitted keys and values; like IndexWriter::update, except that
+            nothing is written to the index until finish() is called. */
+        bool add(slice docID,
+                 sequence docSequence,
+                 const std::vector<Collatable> &keys,
+                 const std::vector<alloc_slice> &values,
+                 uint64_t &rowCount);
+
+        /** Writes all the added rows to the index. */
+        void finish(Transaction&);
+
+    private:
+        class Sorter;
+
+        void spillAggregates();
+
+        Index* _index;
+        std::unique_ptr<Sorter> _rows, _docs;
+        std::map<std::string, RowAggregate> _aggregates; // aggregate key -> totals since last spill
+        std::unique_ptr<Sorter> _aggregateRuns;         // spilled partial totals
+        const size_t _maxAggregates;                    // max size of _aggregates before spilling
+    };
+
+
+    /** The postings of one text token: where it occurs in one text emitted by
+        EmitFn::emitTextTokens. This is the value of each full-text index row. It's stored as
+        varints: the fullTextID, the number of occurrences, then for each occurrence its word
+        number and byte offset (both as deltas from the previous occurrence) and byte length. */
+    struct TextPostings {
+        struct Position {
+            uint32_t word;              // Ordinal of the word in the text, counting stopwords
+            uint32_t offset, length;    // Byte range of the word in the text
+        };
+
+        unsigned fullTextID;
+        std::vector<Position> positions;    // In text order
+
+        /** Appends the encoded form to a string, which can be reused between calls. */
+        void encode(std::string &out) const;
+        /** Decodes an encoded form, returning false if it's not valid. */
+        bool decode(slice);
+    };
+
+
+    /** Index query enumerator.
+        Rows are returned in key order; rows with equal keys are ordered by docID, which
+        startKeyDocID/endKeyDocID bound.
+        If the options' contentOptions include KeyStore::kMetaOnly, only keys are read: the rows'
+        values and docIDs will be null and their sequences 0. This is much faster for counting. */
     class IndexEnumerator {
     public:
         IndexEnumerator(Index*,
@@ -89,9 +224,16 @@ namespace forestdb {
                         Collatable endKey, slice endKeyDocID,
                         const DocEnumerator::Options&);
 
+        /** Enumerates the rows in a set of key ranges. The ranges are sorted and merged where they
+            overlap, so the index is read in a single pass and each row is returned only once,
+            in key order. If inCallerOrder is true, the rows are instead returned in the order of
+            the keyRanges (including repeats for a repeated range), as CouchDB does for `keys`;
+            they're still read in a single pass, but buffered, and only as far as the options'
+            skip and limit require. */
         IndexEnumerator(Index*,
                         std::vector<KeyRange> keyRanges,
-                        const DocEnumerator::Options&);
+                        const DocEnumerator::Options&,
+                        bool inCallerOrder =false);
 
         virtual ~IndexEnumerator()              { }
 
@@ -109,6 +251,9 @@ namespace forestdb {
             fullTextID will be set to the ID of the string these tokens came from. */
         std::vector<size_t> getTextTokenInfo(unsigned &fullTextID);
 
+        /** Decodes the current row's full-text postings; returns false if it's not a text row. */
+        bool getTextPostings(TextPostings &postings) const {return postings.decode(value());}
+
         bool next();
 
     protected:
@@ -118,7 +263,18 @@ namespace forestdb {
 
     private:
         friend class Index;
-        void nextKeyRange();
+        friend class MergedIndexEnumerator;
+        void seekToKeyRange();
+        bool isPastKeyRange(slice key) const;
+        bool hasReachedKeyRange(slice key) const;
+        bool nextInCallerOrder();
+        void bufferRows(const KeyRange&, size_t wanted);
+        void findBufferedRows(const KeyRange&);
+
+        struct Row {
+            alloc_slice key, value, docID;
+            ::forestdb::sequence sequence;
+        };
 
         Index* _index;
         DocEnumerator::Options _options;
@@ -126,16 +282,126 @@ namespace forestdb {
         alloc_slice _endKey;
         bool _inclusiveStart;
         bool _inclusiveEnd;
-        std::vector<KeyRange> _keyRanges;
+        std::vector<KeyRange> _keyRanges;   // sorted & merged, in enumeration order
         int _currentKeyIndex;
 
+        // Used when returning rows in caller order:
+        std::vector<KeyRange> _callerRanges;
+        std::vector<Row> _rows;             // rows read so far, in sorted order
+        bool _rowsRead;                     // true once all rows have been read
+        size_t _callerIndex, _rowIndex, _rowEnd;
+        unsigned _callerSkip, _callerLimit;
+
         DocEnumerator _dbEnum;
+        slice _rowKey;      // the row's entire stored key: key, docID, emitIndex
         slice _key;
         slice _value;
         alloc_slice _docID;
         ::forestdb::sequence _sequence;
     };
 
+
+    /** Enumerates the rows of several Indexes as if they were one, e.g. the shards of a sharded
+        MapReduceIndex. Each index is read by its own IndexEnumerator, and their rows are merged
+        in collation order (the same order a single index containing all the rows would have.)
+        The options' skip and limit apply to the merged rows. */
+    class MergedIndexEnumerator {
+    public:
+        MergedIndexEnumerator(std::vector<Index*>,
+                              Collatable startKey, slice startKeyDocID,
+                              Collatable endKey, slice endKeyDocID,
+                              const DocEnumerator::Options&);
+
+        MergedIndexEnumerator(std::vector<Index*>,
+                              std::vector<KeyRange> keyRanges,
+                              const DocEnumerator::Options&);
+
+        /** The enumerator of the index the current row came from. */
+        IndexEnumerator& current() const        {return *_enums[_current];}
+
+        CollatableReader key() const            {return current().key();}
+        slice value() const                     {return current().value();}
+        slice docID() const                     {return current().docID();}
+        forestdb::sequence sequence() const     {return current().sequence();}
+
+        bool next();
+
+    private:
+        static DocEnumerator::Options subOptions(const DocEnumerator::Options&);
+
+        std::vector<std::unique_ptr<IndexEnumerator>> _enums;
+        std::vector<bool> _hasRow;          // whether each of _enums is positioned on a row
+        bool _started;
+        bool _descending;
+        unsigned _skip, _limit;
+        size_t _current;
+    };
+
+
+    /** Aggregates the rows of an IndexEnumerator with one of the built-in reduce functions,
+        producing one row per group instead of one per index row. A group is a run of rows whose
+        keys are equal, or whose array keys are equal in their first groupLevel items. Without
+        grouping, the entire range reduces to a single row whose key is null.
+        Skip and limit apply to the reduced rows, so the row enumerator shouldn't have any. */
+    class ReduceEnumerator : public CollatableTypes {
+    public:
+        enum ReduceType {
+            kCount,         // Number of rows
+            kSum,           // Sum of the rows' values, which must be numbers
+            kStats          // {"sum","count","min","max","sumsqr"} of the rows' values
+        };
+
+        ReduceEnumerator(IndexEnumerator &rows,
+                         ReduceType type,
+                         bool group, unsigned groupLevel,
+                         unsigned skip, unsigned limit);
+
+        /** Reduces a key range of an index from its aggregates instead of its rows, so that only
+            the rows at the ends of the range (or of each group) need to be read. Only valid if
+            canUseAggregates() returns true. The options' skip and limit apply to the groups. */
+        ReduceEnumerator(Index*,
+                         Collatable startKey, Collatable endKey,
+                         const DocEnumerator::Options&,
+                         ReduceType type, unsigned groupLevel);
+
+        /** Returns true if an index's aggregates can compute a reduce: they have counts and sums,
+            but no minima or maxima, at group levels up to Index::aggregateLevels(). */
+        static bool canUseAggregates(const Index*, ReduceType, bool group, unsigned groupLevel);
+
+        CollatableReader key() const            {return CollatableReader(slice(_groupKey));}
+        slice value() const                     {return slice(_value);}
+
+        bool next();
+
+        /** Interprets an index row's value as a number: either a JSON number or a Collatable-
+            encoded one. Throws InvalidReduceValue if it's anything else. */
+        static double numericValue(slice value);
+
+    private:
+        slice groupPrefix(slice key) const;
+        bool nextFromAggregates();
+        void setValue(uint64_t count, double sum, double sumsqr, double min, double max);
+
+        IndexEnumerator *_rows;
+        Index *_index;
+        ReduceType _type;
+        bool _group;
+        unsigned _groupLevel;
+        unsigned _skip, _limit;
+        bool _started;
+        bool _hasRow;
+        std::string _groupPrefix;
+        std::string _groupKey;
+        std::string _value;
+
+        // Used when reducing from aggregates:
+        bool _descending;
+        alloc_slice _lowKey, _highKey;
+        bool _inclusiveLow, _inclusiveHigh;
+        std::string _lowGroup, _highGroup;
+        DocEnumerator _groups;
+    };
+
 }
 
 #endif /* defined(__CBForest__Index__) */
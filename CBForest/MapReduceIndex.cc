@@ -19,16 +19,25 @@
 #include "Tokenizer.hh"
 #include "LogInternal.hh"
 #include <algorithm>
+#include <set>
 
 namespace forestdb {
 
-    static int64_t kMinFormatVersion = 4;
-    static int64_t kCurFormatVersion = 4;
+    // Version 5 stores 64-bit hashes of each row's value in the back-index (see Index.cc)
+    // Version 6 refers to docs by docRef in row keys, and moves the back-index to a docs store
+    // Version 7 stores full-text rows' token positions as delta-varint postings (TextPostings)
+    // Version 8 adds reduce totals for leading-byte prefixes of the keys to the aggregates
+    // Version 9 stores docIDs in row keys again instead of docRefs, to sort equal keys by docID
+    // Version 10 counts stopwords in full-text word positions, as the query does
+    static int64_t kMinFormatVersion = 10;
+    static int64_t kCurFormatVersion = 10;
 
     MapReduceIndex::MapReduceIndex(Database* db, std::string name, KeyStore sourceStore)
     :Index(db, name),
      _sourceDatabase(sourceStore), _map(NULL), _indexType(0),
-     _lastSequenceIndexed(0), _lastSequenceChangedAt(0), _stateReadAt(0), _rowCount(0)
+     _lastSequenceIndexed(0), _lastSequenceChangedAt(0), _stateReadAt(0), _rowCount(0),
+     _shard(0), _shardCount(1),
+     _obsolete(false)
     {
         readState();
     }
@@ -50,9 +59,18 @@ namespace forestdb {
 
                 if (reader.peekTag() == CollatableTypes::kEndSequence
                         || reader.readInt() < kMinFormatVersion) {
-                    // Obsolete index version
+                    // Obsolete index version; setup() will erase it
                     deleted();
                     _indexType = 0;
+                    _obsolete = true;
+                } else if (reader.peekTag() != CollatableTypes::kEndSequence) {
+                    Index::setAggregateLevels((unsigned)reader.readInt());
+                    _shard = 0;
+                    _shardCount = 1;
+                    if (reader.peekTag() != CollatableTypes::kEndSequence) {
+                        _shard = (unsigned)reader.readInt();
+                        _shardCount = (unsigned)reader.readInt();
+                    }
                 }
             }
             _stateReadAt = curIndexSeq;
@@ -63,6 +81,11 @@ namespace forestdb {
 
     void MapReduceIndex::saveState(Transaction& t) {
         CBFAssert(t.database()->contains(*this));
+        flushPendingUpdates(t);
+        if (_bulkLoader) {
+            _bulkLoader->finish(t);
+            _bulkLoader.reset();
+        }
         _lastMapVersion = _mapVersion;
 
         Collatable stateKey;
@@ -71,7 +94,9 @@ namespace forestdb {
         Collatable state;
         state.beginArray();
         state << _lastSequenceIndexed << _lastSequenceChangedAt << _lastMapVersion << _indexType
-              << _rowCount << kCurFormatVersion;
+              << _rowCount << kCurFormatVersion << aggregateLevels();
+        if (_shardCount > 1)
+            state << _shard << _shardCount;
         state.endArray();
 
         _stateReadAt = t(this).set(stateKey, state);
@@ -85,6 +110,8 @@ namespace forestdb {
         _lastMapVersion = "";
         _stateReadAt = 0;
         _rowCount = 0;
+        _shard = 0;
+        _shardCount = 1;
     }
 
     sequence MapReduceIndex::lastSequenceIndexed() const {
@@ -103,19 +130,32 @@ namespace forestdb {
     }
 
 
-    void MapReduceIndex::setup(Transaction &t, int indexType, MapFn *map, std::string mapVersion) {
-        Debug("MapReduceIndex<%p>: Setup (indexType=%ld, mapFn=%p, mapVersion='%s')",
-              this, indexType, map, mapVersion.c_str());
+    void MapReduceIndex::setup(Transaction &t, int indexType, MapFn *map, std::string mapVersion,
+                               unsigned aggregateLevels,
+                               unsigned shard, unsigned shardCount)
+    {
+        Debug("MapReduceIndex<%p>: Setup (indexType=%ld, mapFn=%p, mapVersion='%s', aggregateLevels=%u, shard=%u/%u)",
+              this, indexType, map, mapVersion.c_str(), aggregateLevels, shard, shardCount);
         CBFAssert(t.database()->contains(*this));
+        CBFAssert(shardCount > 0 && shard < shardCount);
         readState();
         _map = map;
         _mapVersion = mapVersion;
-        if (indexType != _indexType || mapVersion != _lastMapVersion) {
+        if (shardCount == 1)
+            shard = 0;
+        if (indexType != _indexType || mapVersion != _lastMapVersion
+                                    || aggregateLevels != this->aggregateLevels()
+                                    || shard != _shard || shardCount != _shardCount) {
             _indexType = indexType;
-            if (_lastSequenceIndexed > 0) {
-                Debug("MapReduceIndex: Version or indexType changed; erasing");
-                KeyStore::erase(t);
+            if (_lastSequenceIndexed > 0 || _obsolete) {
+                Debug("MapReduceIndex: Version, indexType, aggregateLevels or sharding changed; erasing");
+                eraseAll(t);
+                _obsolete = false;
             }
+            Index::setAggregateLevels(aggregateLevels);
+            _shard = shard;
+            _shardCount = shardCount;
+            discardPendingUpdates();
             _lastSequenceIndexed = _lastSequenceChangedAt = 0;
             _rowCount = 0;
             _stateReadAt = 0;
@@ -125,12 +165,24 @@ namespace forestdb {
     void MapReduceIndex::erase(Transaction& t) {
         Debug("MapReduceIndex: Erasing");
         CBFAssert(t.database()->contains(*this));
-        KeyStore::erase(t);
+        eraseAll(t);
+        discardPendingUpdates();
+        _obsolete = false;
         _lastSequenceIndexed = _lastSequenceChangedAt = 0;
         _rowCount = 0;
         _stateReadAt = 0;
     }
 
+    unsigned MapReduceIndex::shardForDocID(slice docID, unsigned shardCount) {
+        // 32-bit FNV-1a; it only has to be stable and spread docIDs evenly:
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < docID.size; ++i) {
+            hash ^= ((const uint8_t*)docID.buf)[i];
+            hash *= 16777619u;
+        }
+        return hash % shardCount;
+    }
+
     alloc_slice MapReduceIndex::getSpecialEntry(slice docID, sequence seq, unsigned entryID)
     {
         // This data was written by emitter::emitTextTokens, below
@@ -179,6 +231,197 @@ namespace forestdb {
     }
 
 
+#pragma mark - FULL-TEXT QUERY
+
+
+    FullTextQuery::FullTextQuery(MapReduceIndex *index, slice queryText, Mode mode,
+                                 unsigned distance)
+    :_index(index),
+     _mode(mode),
+     _distance(distance)
+    {
+        // Split at whitespace first, since the tokenizer would strip a trailing '*':
+        PooledTokenizer tokenizer = Tokenizer::borrow();
+        std::string text = (std::string)queryText;
+        uint32_t wordCount = 0;     // words so far, including stopwords, to match the postings
+        for (size_t start = 0; start < text.size(); ) {
+            size_t end = text.find_first_of(" \t\r\n", start);
+            if (end == std::string::npos)
+                end = text.size();
+            std::string word = text.substr(start, end - start);
+            bool prefix = (!word.empty() && word[word.size()-1] == '*');
+            if (prefix)
+                word.resize(word.size() - 1);
+            size_t firstTerm = _terms.size();
+            TokenIterator i(*tokenizer, slice(word), false);
+            for (; i; ++i) {
+                Term term = {i.token(), false, wordCount + i.wordPosition()};
+                _terms.push_back(term);
+            }
+            wordCount += i.wordCount();
+            if (prefix && _terms.size() > firstTerm)
+                _terms.back().prefix = true;
+            start = end + 1;
+        }
+    }
+
+    // Reads the postings of every row whose key is the term, grouped by the text they're in.
+    void FullTextQuery::readTerm(const Term &term, TermHits &hits) {
+        Collatable startKey(term.token);
+        Collatable endKey;                  // Prefix terms read on until the prefix changes
+        if (!term.prefix)
+            endKey = startKey;
+        IndexEnumerator e(_index, startKey, slice::null, endKey, slice::null,
+                          DocEnumerator::Options::kDefault);
+        TextPostings postings;
+        while (e.next()) {
+            if (term.prefix) {
+                if (e.key().peekTag() != CollatableReader::kString)
+                    break;
+                std::string token = e.textToken();
+                if (token.compare(0, term.token.size(), term.token) != 0)
+                    break;
+            }
+            if (!e.getTextPostings(postings))
+                continue; // not a full-text row
+            Hit &hit = hits[TextKey((std::string)e.docID(), postings.fullTextID)];
+            hit.docSequence = e.sequence();
+            hit.positions.insert(hit.positions.end(),
+                                 postings.positions.begin(), postings.positions.end());
+        }
+        if (term.prefix) {
+            // Several tokens may have matched, so put their positions back in text order:
+            for (auto h = hits.begin(); h != hits.end(); ++h) {
+                std::sort(h->second.positions.begin(), h->second.positions.end(),
+                          [](const TextPostings::Position &a, const TextPostings::Position &b) {
+                              return a.word < b.word;
+                          });
+            }
+        }
+    }
+
+    static const TextPostings::Position* findWord(const std::vector<TextPostings::Position> &ps,
+                                                  uint32_t word)
+    {
+        auto p = std::lower_bound(ps.begin(), ps.end(), word,
+                                  [](const TextPostings::Position &pos, uint32_t w) {
+                                      return pos.word < w;
+                                  });
+        return (p != ps.end() && p->word == word) ? &*p : NULL;
+    }
+
+    // Finds every place where each term is at the same distance from the first term as in the
+    // query. (A stopword in the query, which isn't a term, leaves a gap that any word fills.)
+    bool FullTextQuery::matchPhrase(const std::vector<const Hit*> &hits, Match &match) const {
+        auto &first = hits[0]->positions;
+        for (auto p = first.begin(); p != first.end(); ++p) {
+            size_t matchStart = match.positions.size();
+            match.positions.push_back(*p);
+            for (size_t i = 1; i < hits.size(); ++i) {
+                auto next = findWord(hits[i]->positions,
+                                     p->word + (_terms[i].word - _terms[0].word));
+                if (!next) {
+                    match.positions.resize(matchStart);
+                    break;
+                }
+                match.positions.push_back(*next);
+            }
+        }
+        return !match.positions.empty();
+    }
+
+    // Slides a window over all the terms' occurrences in text order, looking for one that
+    // contains every term within the allowed span of words.
+    bool FullTextQuery::matchNear(const std::vector<const Hit*> &hits, Match &match) const {
+        struct Occurrence {
+            TextPostings::Position pos;
+            size_t term;
+        };
+        std::vector<Occurrence> all;
+        for (size_t i = 0; i < hits.size(); ++i) {
+            auto &ps = hits[i]->positions;
+            for (auto p = ps.begin(); p != ps.end(); ++p) {
+                Occurrence occ = {*p, i};
+                all.push_back(occ);
+            }
+        }
+        std::sort(all.begin(), all.end(), [](const Occurrence &a, const Occurrence &b) {
+            return a.pos.word < b.pos.word;
+        });
+
+        std::vector<unsigned> counts(hits.size(), 0);
+        size_t termsInWindow = 0, left = 0;
+        uint32_t maxSpan = _distance + (uint32_t)hits.size() - 1;
+        for (size_t right = 0; right < all.size(); ++right) {
+            if (counts[all[right].term]++ == 0)
+                ++termsInWindow;
+            // Drop occurrences off the left while their terms are still covered further right:
+            while (counts[all[left].term] > 1) {
+                --counts[all[left].term];
+                ++left;
+            }
+            if (termsInWindow == hits.size()
+                    && all[right].pos.word - all[left].pos.word <= maxSpan) {
+                for (size_t i = left; i <= right; ++i)
+                    match.positions.push_back(all[i].pos);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<FullTextQuery::Match> FullTextQuery::run() {
+        std::vector<Match> matches;
+        if (_terms.empty())
+            return matches;
+        std::vector<TermHits> termHits(_terms.size());
+        size_t rarest = 0;
+        for (size_t i = 0; i < _terms.size(); ++i) {
+            readTerm(_terms[i], termHits[i]);
+            if (termHits[i].size() < termHits[rarest].size())
+                rarest = i;
+        }
+
+        // Look up each text containing the rarest term in the other terms' hits:
+        std::vector<const Hit*> hits(_terms.size());
+        for (auto h = termHits[rarest].begin(); h != termHits[rarest].end(); ++h) {
+            bool inAll = true;
+            for (size_t i = 0; i < _terms.size() && inAll; ++i) {
+                auto found = termHits[i].find(h->first);
+                inAll = (found != termHits[i].end());
+                if (inAll)
+                    hits[i] = &found->second;
+            }
+            if (!inAll)
+                continue;
+
+            Match match;
+            bool matched;
+            if (_terms.size() == 1 || _mode == kAllTerms) {
+                for (auto hit = hits.begin(); hit != hits.end(); ++hit)
+                    match.positions.insert(match.positions.end(),
+                                           (*hit)->positions.begin(), (*hit)->positions.end());
+                std::sort(match.positions.begin(), match.positions.end(),
+                          [](const TextPostings::Position &a, const TextPostings::Position &b) {
+                              return a.word < b.word;
+                          });
+                matched = true;
+            } else if (_mode == kPhrase) {
+                matched = matchPhrase(hits, match);
+            } else {
+                matched = matchNear(hits, match);
+            }
+            if (matched) {
+                match.docID = alloc_slice(h->first.first);
+                match.docSequence = h->second.docSequence;
+                match.fullTextID = h->first.second;
+                matches.push_back(std::move(match));
+            }
+        }
+        return matches;
+    }
+
+
 #pragma mark - MAP-REDUCE INDEXER
 
 
@@ -186,14 +429,9 @@ namespace forestdb {
     class emitter : public EmitFn {
     public:
         emitter()
-        :_tokenizer(NULL),
-         _emitCount(0)
+        :_emitCount(0)
         { }
 
-        virtual ~emitter() {
-            delete _tokenizer;
-        }
-
         inline void emit(Collatable key, slice value) {
             keys.push_back(key);
             values.push_back(alloc_slice(value));
@@ -205,30 +443,43 @@ namespace forestdb {
         }
 
         void emitTextTokens(slice text, slice value) {
-            if (!_tokenizer)
-                _tokenizer = new Tokenizer();
-            std::unordered_map<std::string, Collatable> tokens;
+            // Each indexer thread borrows its own tokenizer from the pool:
+            PooledTokenizer tokenizer = Tokenizer::borrow();
+            // The distinct tokens go in _tokens; every occurrence goes in the flat _positions
+            // array, instead of a separately allocated array per token.
+            _tokens.clear();
+            _positions.clear();
             int specialKey = -1;
-            for (TokenIterator i(*_tokenizer, slice(text), false); i; ++i) {
+            for (TokenIterator i(*tokenizer, slice(text), false); i; ++i) {
                 if (specialKey < 0) {
                     // Emit the full text being indexed, and the value, under a special key.
                     specialKey = emitSpecial(text, value);
                 }
-                // Add the word position to the value array for this token:
-                Collatable& tokValue = tokens[i.token()];
-                if (tokValue.empty()) {
-                    tokValue.beginArray();
-                    tokValue << specialKey;
-                }
-                tokValue << i.wordOffset() << i.wordLength();
+                bool isNew;
+                TokenPosition pos;
+                pos.token = _tokens.insert(i.tokenSlice(), isNew);
+                pos.pos.word = i.wordPosition();    // stopwords are counted, too
+                pos.pos.offset = (uint32_t)i.wordOffset();
+                pos.pos.length = (uint32_t)i.wordLength();
+                _positions.push_back(pos);
             }
 
-            // Emit each token string and value array as a key:
-            for (auto kv = tokens.begin(); kv != tokens.end(); ++kv) {
-                Collatable collKey(kv->first);
-                Collatable& collValue = kv->second;
-                collValue.endArray();
-                emit(collKey, collValue);
+            // Group the positions by token, keeping each token's positions in text order:
+            std::stable_sort(_positions.begin(), _positions.end(),
+                             [](const TokenPosition &a, const TokenPosition &b) {
+                                 return a.token < b.token;
+                             });
+
+            // Emit each token string as a key, with its postings as the value:
+            _postings.fullTextID = specialKey;
+            for (auto pos = _positions.begin(); pos != _positions.end(); ) {
+                unsigned token = pos->token;
+                _postings.positions.clear();
+                for (; pos != _positions.end() && pos->token == token; ++pos)
+                    _postings.positions.push_back(pos->pos);
+                _encodedPostings.clear();
+                _postings.encode(_encodedPostings);
+                emit(Collatable(_tokens[token]), slice(_encodedPostings));
             }
         }
 
@@ -282,33 +533,90 @@ namespace forestdb {
         std::vector<alloc_slice> values;
 
     private:
-        Tokenizer* _tokenizer;
+        struct TokenPosition {
+            unsigned token;             // index in _tokens
+            TextPostings::Position pos;
+        };
+
         unsigned _emitCount;
+        TokenSet _tokens;
+        std::vector<TokenPosition> _positions;
+        TextPostings _postings;
+        std::string _encodedPostings;
     };
 
 
-    bool MapReduceIndex::updateDocInIndex(Transaction& t, const Mappable& mappable) {
+    void MapReduceIndex::updateDocInIndex(Transaction& t, const Mappable& mappable) {
         CBFAssert(t.database()->contains(*this));
-        CBFAssert(_map != NULL);
         const Document& doc = mappable.document();
         if (doc.sequence() <= _lastSequenceIndexed)
-            return false;
+            return;
+        std::vector<Collatable> keys;
+        std::vector<alloc_slice> values;
+        mapDocument(mappable, keys, values);
+        emitForDocument(t, doc.key(), doc.sequence(), std::move(keys), std::move(values));
+    }
+
+    // Runs the map function; doesn't touch the index, so it's safe to call on any thread.
+    void MapReduceIndex::mapDocument(const Mappable& mappable,
+                                     std::vector<Collatable> &keys,
+                                     std::vector<alloc_slice> &values) const
+    {
+        CBFAssert(_map != NULL);
         emitter emit;
-        if (!doc.deleted())
+        const Document& doc = mappable.document();
+        if (!doc.deleted() && ownsDocument(doc.key()))
             (*_map)(mappable, emit); // Call map function!
-        return emitForDocument(t, doc.key(), doc.sequence(), emit.keys, emit.values);
+        keys = std::move(emit.keys);
+        values = std::move(emit.values);
     }
 
-    bool MapReduceIndex::emitForDocument(Transaction& t, slice docID, sequence docSequence,
-                                         std::vector<Collatable> keys,
-                                         std::vector<alloc_slice> values)
+    void MapReduceIndex::emitForDocument(Transaction& t, slice docID, sequence docSequence,
+                                         std::vector<Collatable> &&keys,
+                                         std::vector<alloc_slice> &&values)
     {
+        // An empty index can be built much faster with an IndexBulkLoader:
+        if (_lastSequenceIndexed == 0 && _rowCount == 0 && !_bulkLoader)
+            _bulkLoader.reset(new IndexBulkLoader(this));
         _lastSequenceIndexed = docSequence;
-        if (IndexWriter(this,t).update(docID, docSequence, keys, values, _rowCount)) {
-            _lastSequenceChangedAt = _lastSequenceIndexed;
-            return true;
+        if (!ownsDocument(docID))
+            return; // Belongs to another shard, so it never has rows here
+        if (_bulkLoader) {
+            if (_bulkLoader->add(docID, docSequence, keys, values, _rowCount))
+                _lastSequenceChangedAt = docSequence;
+            return;
         }
-        return false;
+
+        // Otherwise queue the update, to be applied along with others in a batch:
+        PendingUpdate update;
+        update.docID = alloc_slice(docID);
+        update.docSequence = docSequence;
+        update.keys = std::move(keys);
+        update.values = std::move(values);
+        _pendingUpdates.push_back(std::move(update));
+        if (_pendingUpdates.size() >= kUpdateBatchSize)
+            flushPendingUpdates(t);
+    }
+
+    void MapReduceIndex::flushPendingUpdates(Transaction& t) {
+        if (_pendingUpdates.empty())
+            return;
+        IndexWriter writer(this, t);
+        std::vector<slice> docIDs;
+        for (auto u = _pendingUpdates.begin(); u != _pendingUpdates.end(); ++u)
+            docIDs.push_back(u->docID);
+        writer.preloadDocs(docIDs);
+        // Apply the updates in sequence order:
+        for (auto u = _pendingUpdates.begin(); u != _pendingUpdates.end(); ++u) {
+            if (writer.update(u->docID, u->docSequence, u->keys, u->values, _rowCount))
+                _lastSequenceChangedAt = u->docSequence;
+        }
+        _pendingUpdates.clear();
+    }
+
+    void MapReduceIndex::discardPendingUpdates() {
+        _pendingUpdates.clear();
+        _bulkLoader.reset();
     }
 
     
@@ -369,11 +677,18 @@ namespace forestdb {
     MapReduceIndexer::~MapReduceIndexer() {
         unsigned i = 0;
         for (auto t = _transactions.begin(); t != _transactions.end(); ++t, ++i) {
-            if (_finished)
+            if (_finished) {
                 _indexes[i]->saveState(**t);
-            else
+            } else {
+                _indexes[i]->discardPendingUpdates();
                 (*t)->abort();
-            delete *t;
+            }
+        }
+        // Indexes in the same Database share a Transaction, so delete each one only once:
+        std::set<Transaction*> deleted;
+        for (auto t = _transactions.begin(); t != _transactions.end(); ++t) {
+            if (deleted.insert(*t).second)
+                delete *t;
         }
     }
 
@@ -391,15 +706,14 @@ namespace forestdb {
     void MapReduceIndexer::emitDocIntoView(slice docID,
                                            sequence docSequence,
                                            unsigned viewNumber,
-                                           std::vector<Collatable> keys,
-                                           std::vector<slice> values)
+                                           std::vector<Collatable> &&keys,
+                                           std::vector<alloc_slice> &&values)
     {
-        emitter emit;
-        for (unsigned i = 0; i < keys.size(); ++i)
-            emit.emit(keys[i], values[i]);
+        if (!viewNeedsSequence(viewNumber, docSequence))
+            return;
         _indexes[viewNumber]->emitForDocument(*_transactions[viewNumber],
                                               docID, docSequence,
-                                              emit.keys, emit.values);
+                                              std::move(keys), std::move(values));
     }
 
 }
@@ -18,6 +18,7 @@
 
 #include "Index.hh"
 #include "Geohash.hh"
+#include <map>
 #include <vector>
 
 
@@ -43,7 +44,8 @@ namespace forestdb {
         virtual void emit(const geohash::area& boundingBox, slice geoJSON, slice value) =0;
 
         /** Emits the text for full-text indexing. Each word in the text will be emitted separately
-            as a string key. When querying, use IndexEnumerator::getTextToken to read the info. */
+            as a string key, with its TextPostings as the value. When querying, use
+            IndexEnumerator::getTextPostings to read the info, or run a FullTextQuery. */
         virtual void emitTextTokens(slice text, slice value) =0;
 
         inline void operator() (Collatable key, slice value) {emit(key, value);}
@@ -68,8 +70,33 @@ namespace forestdb {
         KeyStore sourceStore() const            {return _sourceDatabase;}
         void readState();
         int indexType() const                   {return _indexType;}
+        std::string mapVersion() const          {return _mapVersion;}
         
-        void setup(Transaction&, int indexType, MapFn *map, std::string mapVersion);
+        /** Configures the index. If the indexType, mapVersion, aggregateLevels or sharding differ
+            from the ones the index was built with, it's erased. aggregateLevels is the number of
+            key-prefix levels at which to maintain reduce aggregates (see Index.)
+            If shardCount is greater than 1, the index is one of shardCount shards that split up
+            the source's documents by a hash of their docIDs (see shardForDocID), and only
+            contains rows emitted by the documents of shard number `shard`. */
+        void setup(Transaction&, int indexType, MapFn *map, std::string mapVersion,
+                   unsigned aggregateLevels =0,
+                   unsigned shard =0, unsigned shardCount =1);
+
+        /** Changes the number of aggregate levels set by setup(), erasing the index if different. */
+        void setAggregateLevels(Transaction& t, unsigned levels) {
+            setup(t, _indexType, _map, _mapVersion, levels, _shard, _shardCount);
+        }
+
+        unsigned shard() const                  {return _shard;}
+        unsigned shardCount() const             {return _shardCount;}
+
+        /** The shard (0 ..< shardCount) that a document belongs to. */
+        static unsigned shardForDocID(slice docID, unsigned shardCount);
+
+        /** True if this index's shard contains the document (always true if unsharded.) */
+        bool ownsDocument(slice docID) const {
+            return _shardCount <= 1 || shardForDocID(docID, _shardCount) == _shard;
+        }
 
         /** The last source database sequence number to be indexed. */
         sequence lastSequenceIndexed() const;
@@ -100,9 +127,24 @@ namespace forestdb {
 
     private:
         void saveState(Transaction& t);
-        bool updateDocInIndex(Transaction&, const Mappable&);
-        bool emitForDocument(Transaction& t, slice docID, sequence docSequence,
-                             std::vector<Collatable> keys, std::vector<alloc_slice> values);
+        void discardPendingUpdates();
+        void updateDocInIndex(Transaction&, const Mappable&);
+        void mapDocument(const Mappable&,
+                         std::vector<Collatable> &keys, std::vector<alloc_slice> &values) const;
+        void emitForDocument(Transaction& t, slice docID, sequence docSequence,
+                             std::vector<Collatable> &&keys, std::vector<alloc_slice> &&values);
+        void flushPendingUpdates(Transaction& t);
+
+        /** Number of documents whose index updates are batched together, so their stored keys
+            can be read in a single sorted pass. */
+        static const size_t kUpdateBatchSize = 100;
+
+        struct PendingUpdate {
+            alloc_slice docID;
+            sequence docSequence;
+            std::vector<Collatable> keys;
+            std::vector<alloc_slice> values;
+        };
         alloc_slice getSpecialEntry(slice docID, sequence, unsigned fullTextID);
 
         forestdb::KeyStore _sourceDatabase;
@@ -112,9 +154,68 @@ namespace forestdb {
         sequence _lastSequenceIndexed, _lastSequenceChangedAt;
         sequence _stateReadAt; // index sequence # at which state was last valid
         uint64_t _rowCount;
+        unsigned _shard, _shardCount;
+        bool _obsolete;         // stored index has an unsupported format and must be erased
+        std::unique_ptr<IndexBulkLoader> _bulkLoader; // Used while building an index from scratch
+        std::vector<PendingUpdate> _pendingUpdates;   // Updates not yet written by IndexWriter
 
         friend class MapReduceIndexer;
-        friend class MapReduceDispatchIndexer;
+    };
+
+
+    /** A full-text search of a MapReduceIndex whose map function calls emitTextTokens. It's
+        answered entirely from the postings in the index rows, without reading any source text:
+        each term's rows are read in one pass, then the terms' word positions are intersected
+        within each emitted text.
+        The query text is tokenized the same way as indexed text (so stopwords are dropped and
+        words are stemmed.) A word ending in '*' is a prefix that matches every indexed token
+        starting with it. */
+    class FullTextQuery {
+    public:
+        enum Mode {
+            kAllTerms,      ///< Every term occurs somewhere in the text
+            kPhrase,        ///< The terms occur consecutively, in order
+            kNear,          ///< The terms occur, in any order, with at most `distance` other
+                            ///<    words between the first and last (SQLite's NEAR/distance)
+        };
+
+        struct Match {
+            alloc_slice docID;
+            sequence docSequence;
+            unsigned fullTextID;            // Pass to MapReduceIndex::readFullText for the text
+            std::vector<TextPostings::Position> positions; // The matched words, in text order
+        };
+
+        FullTextQuery(MapReduceIndex*, slice queryText, Mode mode =kAllTerms,
+                      unsigned distance =0);
+
+        /** The number of terms in the query text. With no terms, nothing matches. */
+        size_t termCount() const                {return _terms.size();}
+
+        /** Runs the query, returning the matching texts in docID order. */
+        std::vector<Match> run();
+
+    private:
+        struct Term {
+            std::string token;
+            bool prefix;
+            uint32_t word;          // Position in the query text, counting stopwords
+        };
+        struct Hit {
+            sequence docSequence;
+            std::vector<TextPostings::Position> positions;
+        };
+        typedef std::pair<std::string, unsigned> TextKey;   // (docID, fullTextID)
+        typedef std::map<TextKey, Hit> TermHits;
+
+        void readTerm(const Term&, TermHits&);
+        bool matchPhrase(const std::vector<const Hit*>&, Match&) const;
+        bool matchNear(const std::vector<const Hit*>&, Match&) const;
+
+        MapReduceIndex* _index;
+        Mode _mode;
+        unsigned _distance;
+        std::vector<Term> _terms;
     };
 
 
@@ -124,6 +225,8 @@ namespace forestdb {
         MapReduceIndexer();
         virtual ~MapReduceIndexer();
 
+        /** Adds an index to be updated within the given Transaction, which the indexer takes
+            ownership of. Indexes in the same Database must be given the same Transaction. */
         void addIndex(MapReduceIndex*, Transaction*);
 
         /** If set, indexing will only occur if this index needs to be updated. */
@@ -131,7 +234,7 @@ namespace forestdb {
 
         KeyStore sourceStore();
 
-        bool run();
+        virtual bool run();
 
         void finished()                             {_finished = true;}
 
@@ -143,11 +246,19 @@ namespace forestdb {
             Returns UINT64_MAX if no re-indexing is necessary. */
         sequence startingSequence();
 
+        /** Updates an index with a document's keys and values. Ignored if the index already
+            covers that document sequence. The keys and values are moved into the index's pending
+            updates, not copied, so callers should build them once and std::move them in. */
         void emitDocIntoView(slice docID,
                              sequence docSequence,
                              unsigned viewNumber,
-                             std::vector<Collatable> keys,
-                             std::vector<slice> values);
+                             std::vector<Collatable> &&keys,
+                             std::vector<alloc_slice> &&values);
+
+        /** True if the index at position viewNumber hasn't yet indexed docSequence. */
+        bool viewNeedsSequence(unsigned viewNumber, sequence docSequence) const {
+            return viewNumber >= _lastSequences.size() || docSequence > _lastSequences[viewNumber];
+        }
 
     protected:
         /** Transforms the Document to a Mappable and invokes addMappable.
@@ -166,6 +277,23 @@ namespace forestdb {
                 _indexes[i]->updateDocInIndex(*_transactions[i], mappable);
         }
 
+        /** Runs index i's map function on the Mappable without updating the index (so it can be
+            called on any thread.) Returns false if the index already contains the document. */
+        bool mapDocInIndex(size_t i, const Mappable& mappable,
+                           std::vector<Collatable> &keys, std::vector<alloc_slice> &values) {
+            if (mappable.document().sequence() <= _lastSequences[i])
+                return false;
+            _indexes[i]->mapDocument(mappable, keys, values);
+            return true;
+        }
+
+        /** Updates index i with the results of mapDocInIndex. */
+        void writeDocInIndex(size_t i, slice docID, sequence docSequence,
+                             std::vector<Collatable> &&keys, std::vector<alloc_slice> &&values) {
+            _indexes[i]->emitForDocument(*_transactions[i], docID, docSequence,
+                                         std::move(keys), std::move(values));
+        }
+
     protected:
         std::vector<MapReduceIndex*> _indexes;
         std::vector<Transaction*> _transactions;
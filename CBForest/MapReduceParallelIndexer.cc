@@ -0,0 +1,297 @@
+//
+//  MapReduceParallelIndexer.cc
+//  CBForest
+//
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#include "MapReduceParallelIndexer.hh"
+#include <algorithm>
+
+
+namespace forestdb {
+
+    MapReduceParallelIndexer::MapReduceParallelIndexer(unsigned threadCount)
+    :_threadCount(threadCount ? threadCount : std::max(1u, std::thread::hardware_concurrency())),
+     _mappable(NULL),
+     _generation(0),
+     _nextIndex(0),
+     _pending(0),
+     _stopping(false)
+    { }
+
+    MapReduceParallelIndexer::~MapReduceParallelIndexer() {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopping = true;
+        }
+        _workAvailable.notify_all();
+        for (auto t = _threads.begin(); t != _threads.end(); ++t)
+            t->join();
+        // The base destructor then saves each index's state, on this thread.
+    }
+
+    // Threads are started lazily, since indexes are added after construction.
+    void MapReduceParallelIndexer::startThreads() {
+        size_t nThreads = std::min((size_t)_threadCount, indexCount());
+        for (size_t i = 1; i < nThreads; ++i)   // the calling thread is the first one
+            _threads.push_back(std::thread(&MapReduceParallelIndexer::workerLoop, this));
+    }
+
+    void MapReduceParallelIndexer::addMappable(const Mappable& mappable) {
+        if (_threads.empty())
+            startThreads();
+        if (_threads.empty()) {
+            MapReduceIndexer::addMappable(mappable);
+            return;
+        }
+
+        uint64_t generation;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _mappable = &mappable;
+            generation = ++_generation;
+            _nextIndex = 0;
+            _pending = indexCount();
+            _error = NULL;
+        }
+        _workAvailable.notify_all();
+
+        // Pitch in, then wait for the other threads to finish with this document, since it
+        // isn't valid after we return:
+        runTasks(mappable, generation);
+        std::exception_ptr error;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _workDone.wait(lock, [this]{return _pending == 0;});
+            _mappable = NULL;
+            error = _error;
+        }
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    // Claims and runs unclaimed indexes for one document until there are none left.
+    void MapReduceParallelIndexer::runTasks(const Mappable& mappable, uint64_t generation) {
+        const size_t n = indexCount();
+        for (;;) {
+            size_t i;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (_generation != generation || _nextIndex >= n)
+                    return;
+                i = _nextIndex++;
+            }
+            std::exception_ptr error;
+            try {
+                updateDocInIndex(i, mappable);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            bool done;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (error && !_error)
+                    _error = error;
+                done = (--_pending == 0);
+            }
+            if (done)
+                _workDone.notify_all();
+        }
+    }
+
+    void MapReduceParallelIndexer::workerLoop() {
+        uint64_t lastGeneration = 0;
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;) {
+            _workAvailable.wait(lock, [&]{return _stopping || _generation != lastGeneration;});
+            if (_stopping)
+                return;
+            lastGeneration = _generation;
+            const Mappable* mappable = _mappable;
+            if (!mappable)
+                continue;
+            lock.unlock();
+            runTasks(*mappable, lastGeneration);
+            lock.lock();
+        }
+    }
+
+
+
+#pragma mark - PIPELINED INDEXER:
+
+
+    struct MapReducePipelinedIndexer::MappedDoc {
+        alloc_slice docID;
+        sequence seq;
+        bool aborted;                                   // Not mapped due to a cancel or error
+        std::vector<bool> changed;                      // Does index[i] need to be updated?
+        std::vector<std::vector<Collatable> > keys;     // Keys emitted for index[i]
+        std::vector<std::vector<alloc_slice> > values;  // Values emitted for index[i]
+    };
+
+
+    MapReducePipelinedIndexer::MapReducePipelinedIndexer(unsigned mapThreadCount,
+                                                         size_t queueSize)
+    :_mapThreadCount(mapThreadCount ? mapThreadCount
+                                    : std::max(1u, std::thread::hardware_concurrency())),
+     _queueSize(std::max(queueSize, (size_t)1)),
+     _cancelled(false)
+    { }
+
+    bool MapReducePipelinedIndexer::run() {
+        sequence startSequence = startingSequence();
+        if (startSequence > _latestDbSequence)
+            return false; // no updating needed
+
+        // Start the mapper and writer threads:
+        _readQueue.reset(new BoundedQueue<std::shared_ptr<Document> >(_queueSize));
+        std::vector<std::thread> mappers, writers;
+        for (size_t i = 0; i < indexCount(); ++i) {
+            _writeQueues.emplace_back(new BoundedQueue<MappedDocRef>(_queueSize));
+            writers.push_back(std::thread(&MapReducePipelinedIndexer::writerLoop, this, i));
+        }
+        for (unsigned i = 0; i < _mapThreadCount; ++i)
+            mappers.push_back(std::thread(&MapReducePipelinedIndexer::mapperLoop, this));
+
+        // Read the documents on this thread:
+        try {
+            DocEnumerator::Options options = DocEnumerator::Options::kDefault;
+            options.includeDeleted = true;
+            for (DocEnumerator e(sourceStore(), startSequence, UINT64_MAX, options);
+                     !_cancelled && e.next(); ) {
+                auto doc = std::make_shared<Document>(e.doc());
+                {
+                    // Don't read ahead without limit while an earlier doc is still being mapped:
+                    std::unique_lock<std::mutex> lock(_orderMutex);
+                    _expectedShrank.wait(lock, [this]{
+                        return _expected.size() < 2 * _queueSize + _mapThreadCount;
+                    });
+                    _expected.push_back(doc->sequence());
+                }
+                if (!_readQueue->push(doc))
+                    break;
+            }
+        } catch (...) {
+            recordError(std::current_exception());
+        }
+
+        // Shut down each stage after the one before it has finished:
+        _readQueue->close();
+        for (auto t = mappers.begin(); t != mappers.end(); ++t)
+            t->join();
+        for (auto q = _writeQueues.begin(); q != _writeQueues.end(); ++q)
+            (*q)->close();
+        for (auto t = writers.begin(); t != writers.end(); ++t)
+            t->join();
+        _writeQueues.clear();
+        _readQueue.reset();
+        _expected.clear();
+        _mapped.clear();
+
+        if (_error)
+            std::rethrow_exception(_error);
+        // Even if cancelled, what was written is consistent, so let the indexes save it:
+        finished();
+        return true;
+    }
+
+    void MapReducePipelinedIndexer::mapperLoop() {
+        std::shared_ptr<Document> doc;
+        while (_readQueue->pop(doc)) {
+            bool aborted = _cancelled;
+            if (!aborted) {
+                try {
+                    addDocument(*doc);  // subclass creates a Mappable and calls addMappable
+                } catch (...) {
+                    recordError(std::current_exception());
+                    aborted = true;
+                }
+            }
+            // The writers must get every doc that was read, or the ones after it would wait
+            // forever. That includes docs the subclass chose not to map:
+            deliverUnmapped(doc->sequence(), aborted);
+            doc.reset();
+        }
+    }
+
+    void MapReducePipelinedIndexer::addMappable(const Mappable& mappable) {
+        const Document& doc = mappable.document();
+        auto mapped = std::make_shared<MappedDoc>();
+        mapped->docID = alloc_slice(doc.key());
+        mapped->seq = doc.sequence();
+        mapped->aborted = false;
+        const size_t n = indexCount();
+        mapped->changed.resize(n);
+        mapped->keys.resize(n);
+        mapped->values.resize(n);
+        for (size_t i = 0; i < n; ++i)
+            mapped->changed[i] = mapDocInIndex(i, mappable, mapped->keys[i], mapped->values[i]);
+        deliver(mapped);
+    }
+
+    // Passes a mapped doc to the writers, after all the docs read before it.
+    void MapReducePipelinedIndexer::deliver(MappedDocRef mapped) {
+        std::lock_guard<std::mutex> lock(_orderMutex);
+        _mapped[mapped->seq] = mapped;
+        while (!_expected.empty()) {
+            auto next = _mapped.find(_expected.front());
+            if (next == _mapped.end())
+                break;
+            for (auto q = _writeQueues.begin(); q != _writeQueues.end(); ++q)
+                (*q)->push(next->second);
+            _mapped.erase(next);
+            _expected.pop_front();
+            _expectedShrank.notify_one();
+        }
+    }
+
+    // Delivers an empty placeholder for a doc, unless addMappable already delivered it.
+    void MapReducePipelinedIndexer::deliverUnmapped(sequence seq, bool aborted) {
+        {
+            std::lock_guard<std::mutex> lock(_orderMutex);
+            if (_mapped.count(seq) > 0
+                    || std::find(_expected.begin(), _expected.end(), seq) == _expected.end())
+                return;
+        }
+        auto mapped = std::make_shared<MappedDoc>();
+        mapped->seq = seq;
+        mapped->aborted = aborted;
+        mapped->changed.resize(indexCount(), false);
+        deliver(mapped);
+    }
+
+    void MapReducePipelinedIndexer::writerLoop(size_t i) {
+        MappedDocRef mapped;
+        bool failed = false;
+        while (_writeQueues[i]->pop(mapped)) {
+            if (mapped->aborted)
+                failed = true;  // Stop before the first doc that wasn't mapped
+            if (failed || !mapped->changed[i])
+                continue;   // after a failure, keep draining so the mappers don't block
+            try {
+                writeDocInIndex(i, mapped->docID, mapped->seq,
+                                std::move(mapped->keys[i]), std::move(mapped->values[i]));
+            } catch (...) {
+                failed = true;
+                recordError(std::current_exception());
+            }
+        }
+    }
+
+    void MapReducePipelinedIndexer::recordError(std::exception_ptr error) {
+        std::lock_guard<std::mutex> lock(_errorMutex);
+        if (!_error)
+            _error = error;
+        _cancelled = true;
+    }
+
+}
@@ -0,0 +1,162 @@
+//
+//  MapReduceParallelIndexer.hh
+//  CBForest
+//
+//  Copyright (c) 2026 Couchbase. All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#ifndef __CBForest__MapReduceParallelIndexer__
+#define __CBForest__MapReduceParallelIndexer__
+
+#include "MapReduceIndex.hh"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+
+namespace forestdb {
+
+    /** MapReduceIndexer that uses a pool of threads to run the indexes' map functions on each
+        document in parallel. Each document is still handed to all the indexes before the next
+        one is read, and any one index (and its Transaction) is only used by one thread at a time.
+        Since different indexes are updated concurrently, they shouldn't share a Database. */
+    class MapReduceParallelIndexer : public MapReduceIndexer {
+    public:
+        /** @param threadCount  The number of threads to map on, including the calling thread.
+                    0 means to use one per CPU core. No more threads are used than there are
+                    indexes. */
+        explicit MapReduceParallelIndexer(unsigned threadCount =0);
+        virtual ~MapReduceParallelIndexer();
+
+    protected:
+        virtual void addMappable(const Mappable&);
+
+    private:
+        void startThreads();
+        void workerLoop();
+        void runTasks(const Mappable&, uint64_t generation);
+
+        unsigned _threadCount;
+        std::vector<std::thread> _threads;
+        std::mutex _mutex;
+        std::condition_variable _workAvailable, _workDone;
+        const Mappable* _mappable;      // Document currently being indexed
+        uint64_t _generation;           // Incremented for every document
+        size_t _nextIndex;              // Index of next unclaimed index to update
+        size_t _pending;                // Number of indexes not yet updated with _mappable
+        std::exception_ptr _error;      // First exception thrown while indexing _mappable
+        bool _stopping;
+    };
+
+
+
+    /** A fixed-capacity FIFO queue for handing items between threads. push() blocks while the
+        queue is full and pop() blocks while it's empty. After close(), push() fails and pop()
+        fails once the remaining items have been drained. */
+    template <typename T>
+    class BoundedQueue {
+    public:
+        explicit BoundedQueue(size_t capacity)
+        :_capacity(capacity), _closed(false)
+        { }
+
+        bool push(T item) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _notFull.wait(lock, [this]{return _closed || _items.size() < _capacity;});
+            if (_closed)
+                return false;
+            _items.push_back(std::move(item));
+            _notEmpty.notify_one();
+            return true;
+        }
+
+        bool pop(T &item) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _notEmpty.wait(lock, [this]{return _closed || !_items.empty();});
+            if (_items.empty())
+                return false;
+            item = std::move(_items.front());
+            _items.pop_front();
+            _notFull.notify_one();
+            return true;
+        }
+
+        void close() {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _closed = true;
+            _notFull.notify_all();
+            _notEmpty.notify_all();
+        }
+
+    private:
+        const size_t _capacity;
+        std::deque<T> _items;
+        std::mutex _mutex;
+        std::condition_variable _notFull, _notEmpty;
+        bool _closed;
+    };
+
+
+    /** MapReduceIndexer whose run() overlaps reading, mapping and writing. The calling thread
+        reads documents in sequence order; a pool of mapper threads runs the map functions,
+        finishing documents in any order; and each index has a writer thread that applies the
+        results to it strictly in sequence order. The stages are connected by BoundedQueues, so
+        a slow stage makes the earlier ones wait instead of buffering without limit.
+        Since writes happen in order, an index's lastSequenceIndexed always covers exactly the
+        documents written to it, even if the run is cancelled or a map function throws.
+        An index's map function may be called on several threads at once, so it must be
+        thread-safe. As with MapReduceParallelIndexer, the indexes shouldn't share a Database. */
+    class MapReducePipelinedIndexer : public MapReduceIndexer {
+    public:
+        /** @param mapThreadCount  Number of mapper threads; 0 means one per CPU core.
+            @param queueSize  Capacity of each queue between stages, in documents. */
+        explicit MapReducePipelinedIndexer(unsigned mapThreadCount =0, size_t queueSize =100);
+
+        virtual bool run();
+
+        /** Stops a run in progress; can be called on any thread. Documents already mapped are
+            still written, up to the first one that wasn't, and run() returns normally. */
+        void cancel()                               {_cancelled = true;}
+
+    protected:
+        /** Called on a mapper thread; maps the document and passes it on to the writers. */
+        virtual void addMappable(const Mappable&);
+
+    private:
+        struct MappedDoc;
+        typedef std::shared_ptr<MappedDoc> MappedDocRef;
+
+        void mapperLoop();
+        void writerLoop(size_t indexNum);
+        void deliver(MappedDocRef);
+        void deliverUnmapped(sequence, bool aborted);
+        void recordError(std::exception_ptr);
+
+        unsigned _mapThreadCount;
+        size_t _queueSize;
+        std::unique_ptr<BoundedQueue<std::shared_ptr<Document> > > _readQueue;
+        std::vector<std::unique_ptr<BoundedQueue<MappedDocRef> > > _writeQueues;
+        std::mutex _orderMutex;
+        std::condition_variable _expectedShrank;
+        std::deque<sequence> _expected;             // Sequences read but not yet sent to writers
+        std::map<sequence, MappedDocRef> _mapped;   // Mapped docs waiting for earlier ones
+        std::atomic<bool> _cancelled;
+        std::mutex _errorMutex;
+        std::exception_ptr _error;
+    };
+
+}
+
+#endif /* defined(__CBForest__MapReduceParallelIndexer__) */
@@ -303,16 +303,6 @@ namespace forestdb {
         return alloc_slice(); // VersionedDocument overrides this
     }
 
-    bool RevTree::confirmLeaf(Revision* testRev) {
-        int index = testRev->index();
-        for (auto rev = _revs.begin(); rev != _revs.end(); ++rev)
-            if (rev->parentIndex == index)
-                return false;
-        testRev->addFlag(Revision::kLeaf);
-        return true;
-    }
-    
-
 #pragma mark - INSERTION:
 
     // Lowest-level insert method. Does no sanity checking, always inserts.
@@ -443,26 +433,43 @@ namespace forestdb {
         return commonAncestorIndex;
     }
 
+    // Returns the number of children of each revision, indexed like _revs.
+    std::vector<uint16_t> RevTree::childCounts() const {
+        std::vector<uint16_t> counts(_revs.size(), 0);
+        for (auto rev = _revs.begin(); rev != _revs.end(); ++rev)
+            if (rev->parentIndex != Revision::kNoParent)
+                ++counts[rev->parentIndex];
+        return counts;
+    }
+
     unsigned RevTree::prune(unsigned maxDepth) {
         if (maxDepth == 0 || _revs.size() <= maxDepth)
             return 0;
 
-        // First find all the leaves, and walk from each one down to its root:
-        int numPruned = 0;
-        Revision* rev = &_revs[0];
-        for (unsigned i=0; i<_revs.size(); i++,rev++) {
-            if (rev->isLeaf()) {
-                // Starting from a leaf rev, trace its ancestry to find its depth:
-                unsigned depth = 0;
-                for (Revision* anc = rev; anc; anc = (Revision*)anc->parent()) {
-                    if (++depth > maxDepth) {
-                        // Mark revs that are too far away:
-                        anc->revID.size = 0;
-                        numPruned++;
-                    }
-                }
-            } else if (_sorted) {
-                break;
+        // A rev's depth is the length of the longest path from it up to a leaf; it gets pruned
+        // if that's more than maxDepth. Compute the depths in a single pass from the leaves
+        // down to the roots, visiting each rev only after all of its children.
+        auto pendingChildren = childCounts();
+        std::vector<unsigned> depth(_revs.size(), 1);
+        std::vector<uint16_t> ready;
+        ready.reserve(_revs.size());
+        for (uint16_t i = 0; i < _revs.size(); ++i)
+            if (pendingChildren[i] == 0)
+                ready.push_back(i);
+
+        unsigned numPruned = 0;
+        while (!ready.empty()) {
+            uint16_t i = ready.back();
+            ready.pop_back();
+            if (depth[i] > maxDepth) {
+                _revs[i].revID.size = 0;            // mark for pruning
+                numPruned++;
+            }
+            uint16_t parent = _revs[i].parentIndex;
+            if (parent != Revision::kNoParent) {
+                depth[parent] = std::max(depth[parent], depth[i] + 1);
+                if (--pendingChildren[parent] == 0)
+                    ready.push_back(parent);
             }
         }
         if (numPruned > 0)
@@ -475,13 +482,17 @@ namespace forestdb {
         Revision* rev = (Revision*)get(leafID);
         if (!rev || !rev->isLeaf())
             return 0;
-        do {
+        auto children = childCounts();
+        for (;;) {
             nPurged++;
             rev->revID.size = 0;                    // mark for purge
-            const Revision* parent = (Revision*)rev->parent();
+            uint16_t parent = rev->parentIndex;
             rev->parentIndex = Revision::kNoParent; // unlink from parent
-            rev = (Revision*)parent;
-        } while (rev && confirmLeaf(rev));
+            if (parent == Revision::kNoParent || --children[parent] > 0)
+                break;
+            rev = &_revs[parent];                   // parent is now a leaf, so purge it too
+            rev->addFlag(Revision::kLeaf);
+        }
         compact();
         return nPurged;
     }
@@ -26,6 +26,7 @@ namespace forestdb {
 
     class RevTree;
     class RawRevision;
+    class VersionedDocument;
 
     /** In-memory representation of a single revision's metadata. */
     class Revision {
@@ -76,6 +77,7 @@ namespace forestdb {
 #endif
         friend class RevTree;
         friend class RawRevision;
+        friend class VersionedDocument;
     };
 
 
@@ -142,7 +144,7 @@ namespace forestdb {
         friend class Revision;
         const Revision* _insert(revid, slice body, const Revision *parentRev,
                                 bool deleted, bool hasAttachments);
-        bool confirmLeaf(Revision* testRev);
+        std::vector<uint16_t> childCounts() const;
         void compact();
         RevTree(const RevTree&); // forbidden
 
@@ -16,6 +16,8 @@
 #include "Tokenizer.hh"
 #include "english_stopwords.h"
 #include "Error.hh"
+#include <algorithm>
+#include <mutex>
 
 #ifndef __unused
 #define __unused
@@ -34,6 +36,7 @@ namespace forestdb {
 
     static const struct sqlite3_tokenizer_module* sModule;
     static std::unordered_map<std::string, word_set> sStemmerToStopwords;
+    static std::once_flag sModuleOnce;
 
     // Reads a space-delimited list of words from a C string (as found in english_stopwords.h)
     static word_set readWordList(const char* cString) {
@@ -51,17 +54,19 @@ namespace forestdb {
 
     std::string Tokenizer::defaultStemmer;
     bool Tokenizer::defaultRemoveDiacritics = false;
+    const std::string Tokenizer::kDefaultTokenChars = "'’";
 
     Tokenizer::Tokenizer(std::string stemmer, bool removeDiacritics)
     :_stemmer(stemmer),
      _removeDiacritics(removeDiacritics),
      _tokenizer(NULL),
-     _tokenChars("'’")
+     _tokenChars(kDefaultTokenChars)
     {
-        if (!sModule) { //FIX: Make this thread-safe
+        // The module and stopword tables are only written here, once; after that they're read-only.
+        std::call_once(sModuleOnce, [] {
             sqlite3Fts3UnicodeSnTokenizer(&sModule);
             sStemmerToStopwords["english"] = readWordList(kEnglishStopWords);
-        }
+        });
     }
 
     Tokenizer::~Tokenizer() {
@@ -69,7 +74,61 @@ namespace forestdb {
             sModule->xDestroy(_tokenizer);
     }
 
-    sqlite3_tokenizer* Tokenizer::createTokenizer() {
+    // Idle pooled Tokenizers, by configuration (see Tokenizer::borrow)
+    static std::mutex sPoolMutex;
+    static std::unordered_map<std::string, std::vector<Tokenizer*>> sIdleTokenizers;
+
+    PooledTokenizer Tokenizer::borrow(std::string stemmer,
+                                      bool removeDiacritics,
+                                      std::string tokenChars)
+    {
+        std::string poolKey = stemmer;
+        poolKey += '\0';
+        poolKey += (removeDiacritics ? '1' : '0');
+        poolKey += tokenChars;
+        {
+            std::lock_guard<std::mutex> lock(sPoolMutex);
+            auto &idle = sIdleTokenizers[poolKey];
+            if (!idle.empty()) {
+                Tokenizer *tokenizer = idle.back();
+                idle.pop_back();
+                return PooledTokenizer(poolKey, tokenizer);
+            }
+        }
+        Tokenizer *tokenizer = new Tokenizer(stemmer, removeDiacritics);
+        tokenizer->setTokenChars(tokenChars);
+        return PooledTokenizer(poolKey, tokenizer);
+    }
+
+    PooledTokenizer::PooledTokenizer(std::string poolKey, Tokenizer *tokenizer)
+    :_poolKey(poolKey),
+     _tokenizer(tokenizer)
+    { }
+
+    PooledTokenizer::PooledTokenizer(PooledTokenizer &&other)
+    :_poolKey(std::move(other._poolKey)),
+     _tokenizer(other._tokenizer)
+    {
+        other._tokenizer = NULL;
+    }
+
+    PooledTokenizer::~PooledTokenizer() {
+        if (_tokenizer) {
+            std::lock_guard<std::mutex> lock(sPoolMutex);
+            sIdleTokenizers[_poolKey].push_back(_tokenizer);
+        }
+    }
+
+    void Tokenizer::setTokenChars(std::string s) {
+        _tokenChars = s;
+        if (_tokenizer) {
+            // Already created with the old token chars, so recreate it on next use:
+            sModule->xDestroy(_tokenizer);
+            _tokenizer = NULL;
+        }
+    }
+
+    sqlite3_tokenizer* Tokenizer::createTokenizer() const {
         const char* argv[10];
         int argc = 0;
         if (!_removeDiacritics)
@@ -88,14 +147,88 @@ namespace forestdb {
         return err ? NULL : tokenizer;
     }
 
-    sqlite3_tokenizer* Tokenizer::getTokenizer() {
+    sqlite3_tokenizer* Tokenizer::getTokenizer() const {
         if (!_tokenizer)
             _tokenizer = createTokenizer();
         return _tokenizer;
     }
 
     const word_set& Tokenizer::stopwords() const {
-        return sStemmerToStopwords[_stemmer];
+        // Don't use operator[], which would modify the shared map for an unknown stemmer:
+        static const word_set kNoStopwords;
+        auto i = sStemmerToStopwords.find(_stemmer);
+        return (i != sStemmerToStopwords.end()) ? i->second : kNoStopwords;
+    }
+
+
+#pragma mark TOKENSET:
+
+
+    static const size_t kMinTokenSetSlots = 32;     // must be a power of 2
+
+    static inline uint32_t hashToken(slice token) {
+        // FNV-1a
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < token.size; ++i) {
+            hash ^= ((const uint8_t*)token.buf)[i];
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    TokenSet::TokenSet()
+    :_slots(kMinTokenSetSlots, 0)
+    { }
+
+    void TokenSet::clear() {
+        _arena.clear();
+        _entries.clear();
+        std::fill(_slots.begin(), _slots.end(), 0);
+    }
+
+    // Returns the slot holding the token, or else the empty slot where it belongs.
+    size_t TokenSet::findSlot(slice token, uint32_t hash) const {
+        size_t mask = _slots.size() - 1;
+        for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+            uint32_t slot = _slots[i];
+            if (slot == 0)
+                return i;
+            const Entry &entry = _entries[slot - 1];
+            if (entry.hash == hash && (*this)[slot - 1] == token)
+                return i;
+        }
+    }
+
+    void TokenSet::grow() {
+        std::fill(_slots.begin(), _slots.end(), 0);
+        _slots.resize(2 * _slots.size(), 0);
+        size_t mask = _slots.size() - 1;
+        for (uint32_t e = 0; e < _entries.size(); ++e) {
+            size_t i = _entries[e].hash & mask;
+            while (_slots[i] != 0)
+                i = (i + 1) & mask;
+            _slots[i] = e + 1;
+        }
+    }
+
+    unsigned TokenSet::insert(slice token, bool &isNew) {
+        uint32_t hash = hashToken(token);
+        size_t i = findSlot(token, hash);
+        if (_slots[i] != 0) {
+            isNew = false;
+            return _slots[i] - 1;
+        }
+        // Keep the table at most half full:
+        if (2 * (_entries.size() + 1) > _slots.size()) {
+            grow();
+            i = findSlot(token, hash);
+        }
+        Entry entry = {(uint32_t)_arena.size(), (uint32_t)token.size, hash};
+        _arena.append((const char*)token.buf, token.size);
+        _entries.push_back(entry);
+        _slots[i] = (uint32_t)_entries.size();
+        isNew = true;
+        return (unsigned)_entries.size() - 1;
     }
 
 
@@ -107,9 +240,11 @@ namespace forestdb {
     static std::string uncurl(std::string token);
 
 
-    TokenIterator::TokenIterator(Tokenizer &tokenizer, slice text, bool unique)
+    TokenIterator::TokenIterator(const Tokenizer &tokenizer, slice text, bool unique)
     :_stopwords(tokenizer.stopwords()),
-     _unique(unique)
+     _unique(unique),
+     _wordPosition(0),
+     _wordCount(0)
     {
         if (isCurly(text)) {
             // Need to copy the input text in order to convert curly close quotes to apostrophes:
@@ -139,19 +274,22 @@ namespace forestdb {
             _hasToken = (err == SQLITE_OK);
             if (!_hasToken)
                 return false;
+            _wordCount = pos + 1;   // every word counts, even the ones skipped below
             trimQuotes(tokenBytes, tokenLength);
             if (tokenLength == 0)
                 continue;
-            _token = std::string(tokenBytes, tokenLength);
+            _token.assign(tokenBytes, tokenLength);     // reuses _token's buffer
             if (_stopwords.count(_token) > 0)
                 continue; // it's a stop-word
             if (_unique) {
-                auto result = _seen.emplace(_token, true);
-                if (!result.second)
+                bool isNew;
+                _seen.insert(slice(_token), isNew);
+                if (!isNew)
                     continue; // already seen this token, go on to next one
             }
             _wordOffset = startOffset;
             _wordLength = endOffset - startOffset;
+            _wordPosition = pos;
             return true;
         }
     }
@@ -10,7 +10,9 @@
 #define __CBForest__Tokenizer__
 
 #include "slice.hh"
+#include <stdint.h>
 #include <unordered_map>
+#include <vector>
 
 struct sqlite3_tokenizer;
 struct sqlite3_tokenizer_cursor;
@@ -18,6 +20,7 @@ struct sqlite3_tokenizer_cursor;
 namespace forestdb {
 
     class TokenIterator;
+    class PooledTokenizer;
     typedef std::unordered_map<std::string, bool> word_set;
 
     /** A Tokenizer manages tokenization of strings. An instance is configured with a specific
@@ -26,6 +29,15 @@ namespace forestdb {
     public:
         static std::string defaultStemmer;
         static bool defaultRemoveDiacritics;
+        static const std::string kDefaultTokenChars;
+
+        /** Checks out a Tokenizer with the given configuration from a process-wide pool, creating
+            one if none is idle; it goes back to the pool when the PooledTokenizer is destroyed.
+            A Tokenizer mustn't be used by two threads at once (its stemmer keeps state while
+            stemming a word), so every borrower gets its own. Pooled Tokenizers are never freed. */
+        static PooledTokenizer borrow(std::string stemmer = defaultStemmer,
+                                      bool removeDiacritics = defaultRemoveDiacritics,
+                                      std::string tokenChars = kDefaultTokenChars);
 
         /** Initializes a Tokenizer.
             @param stemmer  The name of a stemmer (e.g. "english") or an empty string for language-
@@ -38,21 +50,75 @@ namespace forestdb {
         ~Tokenizer();
 
         /** Defines extra characters that should be considered part of a token. */
-        void setTokenChars(std::string s)   {_tokenChars = s;}
+        void setTokenChars(std::string s);
         std::string tokenChars() const      {return _tokenChars;}
 
     private:
-        sqlite3_tokenizer* createTokenizer();
-        sqlite3_tokenizer* getTokenizer();
+        sqlite3_tokenizer* createTokenizer() const;
+        sqlite3_tokenizer* getTokenizer() const;
         const word_set &stopwords() const;
 
         std::string _stemmer;
         bool _removeDiacritics;
-        struct sqlite3_tokenizer* _tokenizer;
+        mutable struct sqlite3_tokenizer* _tokenizer;
         std::string _tokenChars;
         friend class TokenIterator;
     };
 
+    /** A Tokenizer checked out of the pool by Tokenizer::borrow, which it's returned to when this
+        object is destroyed. */
+    class PooledTokenizer {
+    public:
+        PooledTokenizer(PooledTokenizer&&);
+        ~PooledTokenizer();
+
+        const Tokenizer& operator*() const      {return *_tokenizer;}
+        const Tokenizer* operator->() const     {return _tokenizer;}
+
+    private:
+        friend class Tokenizer;
+        PooledTokenizer(std::string poolKey, Tokenizer*);
+        PooledTokenizer(const PooledTokenizer&);             // not copyable
+        PooledTokenizer& operator=(const PooledTokenizer&);
+
+        std::string _poolKey;
+        Tokenizer* _tokenizer;
+    };
+
+    /** A set of token strings that doesn't allocate per token: the bytes are copied into a
+        single arena and found through an open-addressing hash table. After clear() the buffers
+        keep their capacity, so a reused TokenSet soon stops allocating at all. */
+    class TokenSet {
+    public:
+        TokenSet();
+
+        /** Adds a token if it isn't already present. Returns its index, i.e. the number of
+            distinct tokens added before it, and sets isNew if it was just added. */
+        unsigned insert(slice token, bool &isNew);
+
+        /** The number of distinct tokens. */
+        size_t size() const                     {return _entries.size();}
+
+        /** The token with the given index. Valid until the next insert() or clear(). */
+        slice operator[] (unsigned i) const {
+            return slice(&_arena[_entries[i].offset], _entries[i].size);
+        }
+
+        /** Removes all tokens, without freeing any memory. */
+        void clear();
+
+    private:
+        struct Entry {
+            uint32_t offset, size, hash;
+        };
+        size_t findSlot(slice token, uint32_t hash) const;
+        void grow();
+
+        std::string _arena;             // All the token bytes, back to back
+        std::vector<Entry> _entries;    // Token index -> location in _arena
+        std::vector<uint32_t> _slots;   // Hash table of token index + 1; 0 means empty
+    };
+
     /** Iterates over the word tokens found in a string, as defined by a Tokenizer. */
     class TokenIterator {
     public:
@@ -60,18 +126,25 @@ namespace forestdb {
             @param tokenizer  The tokenizer to use.
             @param text  The input text, as UTF-8 data.
             @param unique  If true, only unique tokens will be returned. */
-        TokenIterator(Tokenizer& tokenizer, slice text, bool unique =false);
+        TokenIterator(const Tokenizer& tokenizer, slice text, bool unique =false);
         ~TokenIterator();
 
         /** True if the iterator has a token, false if it's reached the end. */
         bool hasToken() const           {return _hasToken;}
         /** The current token. */
         std::string token() const       {return _token;}
+        /** The current token, without copying it. Valid only until the next call to next(). */
+        slice tokenSlice() const        {return slice(_token);}
         /** The byte offset in the input string where the tokenized word begins. */
         size_t wordOffset() const      {return _wordOffset;}
         /** The length in bytes of the tokenized word.
             (Will often be longer than the length of the token string due to stemming.) */
         size_t wordLength() const       {return _wordLength;}
+        /** The ordinal of the tokenized word in the input string, counting every word the
+            tokenizer found before it, including stopwords. */
+        unsigned wordPosition() const   {return _wordPosition;}
+        /** The number of words found so far, including stopwords. At the end, the total. */
+        unsigned wordCount() const      {return _wordCount;}
 
         /** Finds the next token, returning false when it reaches the end. */
         bool next();
@@ -87,10 +160,11 @@ namespace forestdb {
         sqlite3_tokenizer_cursor* _cursor;
         const word_set &_stopwords;
         const bool _unique;
-        std::unordered_map<std::string, bool> _seen;
+        TokenSet _seen;
         bool _hasToken;
         std::string _token;
         size_t _wordOffset, _wordLength;
+        unsigned _wordPosition, _wordCount;
     };
 
 }
@@ -126,32 +126,59 @@ namespace forestdb {
         CBFAssert(meta.size == 0);
     }
 
+    // Returns the copy of `rev` found in the older version of this doc stored at `atOffset`.
+    // The decoded older versions are cached, so checking whether a body is available and then
+    // reading it (or walking up a revision history) only reads & decodes each version once.
+    const Revision* VersionedDocument::oldRevision(const Revision* rev, uint64_t atOffset,
+                                        std::shared_ptr<const VersionedDocument> *outOwner) const {
+        if (atOffset == 0 || atOffset >= _doc.offset())
+            return NULL;
+        auto i = _oldVersions.find(atOffset);
+        if (i == _oldVersions.end()) {
+            if (_oldVersions.size() >= kMaxCachedOldVersions)
+                _oldVersions.clear();
+            Document oldDoc = _db.getByOffset(atOffset, rev->sequence);
+            auto oldVersDoc = std::make_shared<VersionedDocument>(_db, std::move(oldDoc));
+            i = _oldVersions.insert(std::make_pair(atOffset, oldVersDoc)).first;
+        }
+        const VersionedDocument* oldVersDoc = i->second.get();
+        if (!oldVersDoc->exists() || oldVersDoc->sequence() != rev->sequence)
+            return NULL;
+        if (outOwner)
+            *outOwner = i->second;
+        return oldVersDoc->get(rev->revID);
+    }
+
     bool VersionedDocument::isBodyOfRevisionAvailable(const Revision* rev, uint64_t atOffset) const {
         if (RevTree::isBodyOfRevisionAvailable(rev, atOffset))
             return true;
-        if (atOffset == 0 || atOffset >= _doc.offset())
-            return false;
-        VersionedDocument oldVersDoc(_db, _db.getByOffset(atOffset, rev->sequence));
-        if (!oldVersDoc.exists() || oldVersDoc.sequence() != rev->sequence)
-            return false;
-        const Revision* oldRev = oldVersDoc.get(rev->revID);
+        const Revision* oldRev = oldRevision(rev, atOffset);
         return (oldRev && RevTree::isBodyOfRevisionAvailable(oldRev, atOffset));
     }
 
     alloc_slice VersionedDocument::readBodyOfRevision(const Revision* rev, uint64_t atOffset) const {
         if (RevTree::isBodyOfRevisionAvailable(rev, atOffset))
             return RevTree::readBodyOfRevision(rev, atOffset);
-        if (atOffset == 0 || atOffset >= _doc.offset())
-            return alloc_slice();
-        VersionedDocument oldVersDoc(_db, _db.getByOffset(atOffset, rev->sequence));
-        if (!oldVersDoc.exists() || oldVersDoc.sequence() != rev->sequence)
-            return alloc_slice();
-        const Revision* oldRev = oldVersDoc.get(rev->revID);
+        const Revision* oldRev = oldRevision(rev, atOffset);
         if (!oldRev)
             return alloc_slice();
         return alloc_slice(oldRev->inlineBody());
     }
 
+    slice VersionedDocument::bodyOfRevision(const Revision* rev,
+                                     std::shared_ptr<const VersionedDocument> &outOwner) const
+    {
+        outOwner.reset();
+        if (rev->inlineBody().buf)
+            return rev->inlineBody();
+        const Revision* oldRev = oldRevision(rev, rev->oldBodyOffset, &outOwner);
+        if (!oldRev) {
+            outOwner.reset();
+            return slice::null;
+        }
+        return oldRev->inlineBody();
+    }
+
     void VersionedDocument::save(Transaction& transaction) {
         if (!_changed)
             return;
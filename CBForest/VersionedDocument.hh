@@ -17,6 +17,8 @@
 #define __CBForest__VersionedDocument__
 #include "RevTree.hh"
 #include "Document.hh"
+#include <memory>
+#include <unordered_map>
 
 namespace forestdb {
 
@@ -62,6 +64,13 @@ namespace forestdb {
         bool changed() const        {return _changed;}
         void save(Transaction& transaction);
 
+        /** Returns a revision's body in place, without copying it. The slice points into this
+            document's storage, or into an older version of the document which is retained by
+            `outOwner`; it remains valid as long as both of those exist.
+            Returns a null slice if the body isn't available. */
+        slice bodyOfRevision(const Revision*,
+                             std::shared_ptr<const VersionedDocument> &outOwner) const;
+
         /** Gets the metadata of a document without having to instantiate a VersionedDocument */
         static bool readMeta(const Document&, Flags&, revid&, slice& docType);
 
@@ -79,13 +88,20 @@ namespace forestdb {
 
     private:
         void decode();
+        const Revision* oldRevision(const Revision*, uint64_t atOffset,
+                                    std::shared_ptr<const VersionedDocument> *outOwner =NULL) const;
         VersionedDocument(const VersionedDocument&); // forbidden
 
+        /** Max number of older document versions (read via getByOffset) to keep decoded. */
+        static const size_t kMaxCachedOldVersions = 8;
+
         KeyStore    _db;
         Document    _doc;
         Flags       _flags;
         revid       _revID;
         alloc_slice _docType;
+        // Older versions of this doc that have been read, keyed by file offset
+        mutable std::unordered_map<uint64_t, std::shared_ptr<VersionedDocument> > _oldVersions;
     };
 }
 
@@ -208,6 +208,48 @@ namespace CBForest
         Special,
         Error = 255
     }
+
+    /// <summary>
+    /// Built-in reduce functions for view queries.
+    /// </summary>
+    public enum C4ReduceType
+    {
+        /// <summary>
+        /// Return the index rows themselves (default)
+        /// </summary>
+        None,
+        /// <summary>
+        /// Number of rows
+        /// </summary>
+        Count,
+        /// <summary>
+        /// Sum of the rows' values, which must be numbers
+        /// </summary>
+        Sum,
+        /// <summary>
+        /// JSON object with "sum", "count", "min", "max" and "sumsqr"
+        /// </summary>
+        Stats
+    }
+
+    /// <summary>
+    /// How a query interacts with a view's background indexer.
+    /// </summary>
+    public enum C4StaleMode
+    {
+        /// <summary>
+        /// Query the index as it is (default)
+        /// </summary>
+        OK,
+        /// <summary>
+        /// Wait for the background indexer to bring the index up to date
+        /// </summary>
+        UpdateBefore,
+        /// <summary>
+        /// Query the index as it is, then wake up the background indexer
+        /// </summary>
+        UpdateAfter
+    }
     
     public enum ForestDBStatus
     {
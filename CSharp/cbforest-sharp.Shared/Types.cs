@@ -449,7 +449,8 @@ namespace CBForest
         /// Default query options.
         /// </summary>
         public static readonly C4QueryOptions DEFAULT = 
-            new C4QueryOptions { limit = UInt32.MaxValue, inclusiveStart = true, inclusiveEnd = true };
+            new C4QueryOptions { limit = UInt32.MaxValue, inclusiveStart = true, inclusiveEnd = true,
+                reduce = C4ReduceType.None, stale = C4StaleMode.OK };
         
         public ulong skip;   
         public ulong limit;
@@ -464,6 +465,12 @@ namespace CBForest
         public C4Key** keys;
         private UIntPtr _keysCount;
 
+        public C4ReduceType reduce;
+        private byte _group;
+        public uint groupLevel;
+        public C4StaleMode stale;
+        private byte _includeDocs;
+
         public bool descending 
         { 
             get { return Convert.ToBoolean (_descending); } 
@@ -487,6 +494,18 @@ namespace CBForest
             get { return _keysCount.ToUInt32(); }
             set { _keysCount = (UIntPtr)value; }
         }
+
+        public bool group
+        {
+            get { return Convert.ToBoolean(_group); }
+            set { _group = Convert.ToByte(value); }
+        }
+
+        public bool includeDocs
+        {
+            get { return Convert.ToBoolean(_includeDocs); }
+            set { _includeDocs = Convert.ToByte(value); }
+        }
     }
 
     /// <summary>
@@ -500,6 +519,8 @@ namespace CBForest
         public C4Slice value;
         public C4Slice docID;
         public ulong docSequence;
+        public C4Slice docRevID;
+        public C4Slice docBody;
     }
 
 
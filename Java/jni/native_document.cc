@@ -213,11 +213,25 @@ JNIEXPORT jbyteArray JNICALL Java_com_couchbase_cbforest_Document_readSelectedBo
 {
     auto doc = (C4Document*)docHandle;
     C4Error error;
-    if (!c4doc_loadRevisionBody(doc, &error)) {
+    // Copy the body straight into the Java array, instead of having c4doc_loadRevisionBody
+    // make an intermediate copy of it:
+    C4BodyReader *reader = c4doc_openRevisionBody(doc, &error);
+    if (!reader) {
         throwError(env, error);
         return NULL;
     }
-    return toJByteArray(env, doc->selectedRev.body);
+    jsize length = (jsize)c4bodyreader_getLength(reader);
+    jbyteArray array = env->NewByteArray(length);
+    if (array && length > 0) {
+        // One copy, from the body in memory into the array's own storage:
+        void *dst = env->GetPrimitiveArrayCritical(array, NULL);
+        if (dst) {
+            c4bodyreader_read(reader, dst, length);
+            env->ReleasePrimitiveArrayCritical(array, dst, 0);
+        }
+    }
+    c4bodyreader_free(reader);
+    return array;
 }
 
 
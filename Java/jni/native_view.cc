@@ -141,17 +141,15 @@ JNIEXPORT jlong JNICALL Java_com_couchbase_cbforest_View_enumerateDocuments
     return (jlong)e;
 }
 
-JNIEXPORT void JNICALL Java_com_couchbase_cbforest_View_emit(JNIEnv *env, jobject self, jlong indexerHandle, jlong documentHandler, jlongArray jkeys, jobjectArray jvalues)
+JNIEXPORT void JNICALL Java_com_couchbase_cbforest_View_emit(JNIEnv *env, jobject self, jlong indexerHandle, jlong documentHandler, jlong keysHandle, jint count, jobjectArray jvalues)
 {
     C4Indexer* indexer = (C4Indexer*)indexerHandle;
     C4Document* doc = (C4Document*)documentHandler;
-    size_t count = env->GetArrayLength(jkeys);
-    jlong *keys   = env->GetLongArrayElements(jkeys, NULL);
-    std::vector<C4Key*> c4keys(count);
+    unsigned emitCount = (unsigned)count;
     std::vector<C4Slice> c4values(count);
     std::vector<jbyteArraySlice> valueBufs;
+    valueBufs.reserve(count);
     for(int i = 0; i < count; i++) {
-        c4keys[i] = (C4Key*)keys[i];
         jbyteArray jvalue = (jbyteArray) env->GetObjectArrayElement(jvalues, i);
         if (jvalue) {
             valueBufs.push_back(jbyteArraySlice(env, jvalue));
@@ -161,15 +159,10 @@ JNIEXPORT void JNICALL Java_com_couchbase_cbforest_View_emit(JNIEnv *env, jobjec
         }
     }
 
+    // All the keys were packed into one C4Key, which the caller frees:
     C4Error error;
-    bool result = c4indexer_emit(indexer, doc, 0, (unsigned)count,
-                                 c4keys.data(), c4values.data(), &error);
-
-    for(int i = 0; i < count; i++)
-        c4key_free(c4keys[i]);
-    env->ReleaseLongArrayElements(jkeys, keys, JNI_ABORT);
-
-    if(!result)
+    if (!c4indexer_emitBatch(indexer, 0, 1, &doc, &emitCount,
+                             (C4Key*)keysHandle, c4values.data(), &error))
         throwError(env, error);
 }
 
@@ -59,15 +59,16 @@ public class View {
     }
 
     public void emit(Document doc, Object[] keys, byte[][] values) throws ForestException {
-
-        // initialize C4Key
-        long keyHandles[] = new long[keys.length];
-        for (int i = 0; i < keys.length; i++) {
-            keyHandles[i] = objectToKey(keys[i]);
+        // Pack all the keys into a single C4Key, one after another, instead of making one each:
+        long keysHandle = newKey();
+        try {
+            for (Object key : keys) {
+                keyAdd(keysHandle, key);
+            }
+            emit(_indexerHandle, doc._handle, keysHandle, keys.length, values);
+        } finally {
+            freeKey(keysHandle);
         }
-
-        emit(_indexerHandle, doc._handle, keyHandles, values);
-        // C4Keys in keyHandles are freed by the native method
     }
 
     public void endIndex(boolean commit) throws ForestException {
@@ -78,7 +79,7 @@ public class View {
     // native methods for indexer
     private native long beginIndex(long dbHandle, long viewHandle) throws ForestException;
     private native long enumerateDocuments(long indexerHandler) throws ForestException;
-    private native void emit(long indexerHandler, long docHandler, long[] keys, byte[][] values) throws ForestException;
+    private native void emit(long indexerHandler, long docHandler, long keys, int count, byte[][] values) throws ForestException;
     private native void endIndex(long indexerHandler, boolean commit) throws ForestException;
     // NOTE: endIndex also frees Indexer
 
@@ -150,6 +150,7 @@ LOCAL_SRC_FILES :=	$(SQLITE3_PATH)/fts3_unicode2.c \
 					$(CBFOREST_PATH)/RevTree.cc \
 					$(CBFOREST_PATH)/VersionedDocument.cc \
 					$(CBFOREST_PATH)/MapReduceIndex.cc \
+					$(CBFOREST_PATH)/MapReduceParallelIndexer.cc \
 					$(CBFOREST_PATH)/Tokenizer.cc \
 					$(CBFOREST_PATH)/sqlite_glue.c \
 					$(LOCAL_PATH)/../C/c4.c \